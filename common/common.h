@@ -0,0 +1,498 @@
+#pragma once
+
+// Parts shared by the single file programs, included by relative path.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////////
+
+inline void Verify(bool predicate)
+{
+    if (!predicate) {
+        throw std::runtime_error("Critical condition is failed");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Differential fuzzing on all cores. Every case is generated by its own PRNG
+// seeded by the run seed and the case number, so a failing case is reproduced
+// by the seed alone, whatever thread has run it.
+struct TFuzzStats
+{
+    int64_t CasesCount = 0;
+    double Seconds = 0;
+    int64_t FailedCase = -1;
+};
+
+inline uint64_t GetCaseSeed(uint64_t seed, int64_t caseNumber)
+{
+    return seed ^ (static_cast<uint64_t>(caseNumber) * 0x9e3779b97f4a7c15);
+}
+
+// Returns the failing case with the smallest number, so the result does not
+// depend on the threads count.
+template <typename TGenerate, typename TIsCorrect>
+auto Fuzz(uint64_t seed, int64_t casesCount, int threadsCount, TGenerate&& generate, TIsCorrect&& isCorrect, TFuzzStats* stats = nullptr)
+    -> std::optional<decltype(generate(std::declval<std::mt19937_64&>()))>
+{
+    static const int64_t BatchSize = 64;
+
+    std::atomic<int64_t> nextCase = 0;
+    std::atomic<int64_t> firstFailed = casesCount;
+    std::atomic<int64_t> checkedCount = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < threadsCount; ++thread) {
+        threads.emplace_back([&] {
+            int64_t checked = 0;
+            for (auto begin = nextCase.fetch_add(BatchSize); begin < firstFailed.load(); begin = nextCase.fetch_add(BatchSize)) {
+                for (auto caseNumber = begin; caseNumber < std::min(begin + BatchSize, firstFailed.load()); ++caseNumber) {
+                    std::mt19937_64 random(GetCaseSeed(seed, caseNumber));
+                    ++checked;
+                    if (isCorrect(generate(random))) {
+                        continue;
+                    }
+
+                    auto failed = firstFailed.load();
+                    while (caseNumber < failed && !firstFailed.compare_exchange_weak(failed, caseNumber)) {
+                    }
+                    break;
+                }
+            }
+            checkedCount += checked;
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (stats) {
+        stats->CasesCount = checkedCount.load();
+        stats->Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (firstFailed.load() == casesCount) {
+        return {};
+    }
+
+    if (stats) {
+        stats->FailedCase = firstFailed.load();
+    }
+
+    std::mt19937_64 random(GetCaseSeed(seed, firstFailed.load()));
+    return generate(random);
+}
+
+// Removes chunks of the input while the case still fails, chunks are halved
+// down to single elements, so no element can be removed from the result. At
+// least one element is kept: programs do not have to handle empty inputs.
+template <typename TCase, typename TIsCorrect>
+TCase Shrink(TCase testCase, TIsCorrect&& isCorrect)
+{
+    for (auto chunk = std::ssize(testCase.Input) / 2; chunk >= 1; chunk /= 2) {
+        for (int64_t begin = 0; begin + chunk <= std::ssize(testCase.Input) && chunk < std::ssize(testCase.Input);) {
+            auto candidate = testCase;
+            candidate.Input.erase(candidate.Input.begin() + begin, candidate.Input.begin() + begin + chunk);
+
+            if (isCorrect(candidate)) {
+                begin += chunk;
+            } else {
+                testCase = std::move(candidate);
+            }
+        }
+    }
+
+    return testCase;
+}
+
+// Runs with the given threads count or with 1, 2, 4, ... up to all hardware
+// threads to show the scaling.
+template <typename TGenerate, typename TIsCorrect, typename TPrint>
+int FuzzTest(uint64_t seed, int64_t casesCount, int threadsCount, TGenerate&& generate, TIsCorrect&& isCorrect, TPrint&& print)
+{
+    std::vector<int> threadCounts{threadsCount};
+    if (threadsCount <= 0) {
+        threadCounts = {1};
+        for (int count = 2; count <= static_cast<int>(std::thread::hardware_concurrency()); count *= 2) {
+            threadCounts.push_back(count);
+        }
+    }
+
+    for (auto count : threadCounts) {
+        TFuzzStats stats;
+        auto failed = Fuzz(seed, casesCount, count, generate, isCorrect, &stats);
+
+        std::cout << "fuzz, seed: " << seed
+            << ", threads: " << count
+            << ", cases: " << stats.CasesCount
+            << ", time: " << stats.Seconds << " s"
+            << ", throughput: " << stats.CasesCount / stats.Seconds << " cases/s"
+            << std::endl;
+
+        if (failed) {
+            std::cout << "Failed case: " << stats.FailedCase << " of " << failed->Input.size() << " elements is shrunk to:" << std::endl;
+            print(Shrink(*failed, isCorrect));
+            return 1;
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Read only mapping of the whole file, the data is used in place.
+struct TMappedFile
+{
+    const char* Data = nullptr;
+    size_t Size = 0;
+
+    explicit TMappedFile(const std::string& path)
+    {
+        auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Can not open " + path);
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("Can not stat " + path);
+        }
+
+        Size = info.st_size;
+        if (Size > 0) {
+            auto* data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Can not map " + path);
+            }
+            madvise(data, Size, MADV_SEQUENTIAL);
+            Data = static_cast<const char*>(data);
+        }
+        close(fd);
+    }
+
+    ~TMappedFile()
+    {
+        if (Data) {
+            munmap(const_cast<char*>(Data), Size);
+        }
+    }
+
+    TMappedFile(const TMappedFile&) = delete;
+    TMappedFile& operator=(const TMappedFile&) = delete;
+
+    std::string_view GetText() const
+    {
+        return {Data, Size};
+    }
+};
+
+// Binary files are the header followed by the records exactly as they are in
+// memory, so the records are used right from the mapping. Byte order is the
+// native one.
+struct TBinaryHeader
+{
+    char Magic[8];
+    uint64_t Count = 0;
+};
+
+// Count of the header matches the file size. The size is divided instead of
+// multiplying the count, which wraps around for a corrupt count.
+template <typename TRecord>
+bool IsValidCount(const TBinaryHeader& header, uint64_t fileSize)
+{
+    return fileSize >= sizeof(TBinaryHeader)
+        && (fileSize - sizeof(TBinaryHeader)) % sizeof(TRecord) == 0
+        && header.Count == (fileSize - sizeof(TBinaryHeader)) / sizeof(TRecord);
+}
+
+inline bool IsBinary(const TMappedFile& file, const char (&magic)[9])
+{
+    return file.Size >= sizeof(TBinaryHeader) && std::memcmp(file.Data, magic, sizeof(TBinaryHeader::Magic)) == 0;
+}
+
+template <typename TRecord>
+std::span<const TRecord> MapRecords(const TMappedFile& file, const char (&magic)[9])
+{
+    static_assert(std::is_trivially_copyable_v<TRecord>);
+    static_assert(sizeof(TBinaryHeader) % alignof(TRecord) == 0);
+
+    Verify(IsBinary(file, magic));
+
+    TBinaryHeader header;
+    std::memcpy(&header, file.Data, sizeof(header));
+    Verify(IsValidCount<TRecord>(header, file.Size));
+
+    return {reinterpret_cast<const TRecord*>(file.Data + sizeof(header)), header.Count};
+}
+
+template <typename TRecord>
+void WriteRecords(const std::string& path, std::span<const TRecord> records, const char (&magic)[9])
+{
+    TBinaryHeader header {.Count = records.size()};
+    std::memcpy(header.Magic, magic, sizeof(header.Magic));
+
+    std::ofstream output(path, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(records.data()), records.size_bytes());
+    Verify(output.good());
+}
+
+// Text is whitespace separated numbers. std::from_chars neither uses locales
+// nor copies the text, so numbers are parsed right from the mapping.
+template <typename TNumber>
+struct TNumberParser
+{
+    const char* Current = nullptr;
+    const char* End = nullptr;
+
+    explicit TNumberParser(std::string_view text)
+        : Current(text.data())
+        , End(text.data() + text.size())
+    { }
+
+    bool SkipSpaces()
+    {
+        while (Current != End && (*Current == ' ' || *Current == '\n' || *Current == '\t' || *Current == '\r')) {
+            ++Current;
+        }
+        return Current != End;
+    }
+
+    TNumber Next()
+    {
+        SkipSpaces();
+
+        TNumber value = 0;
+        auto [end, error] = std::from_chars(Current, End, value);
+        if (error != std::errc()) {
+            throw std::runtime_error("Can not parse number: " + std::string(Current, std::min<size_t>(End - Current, 20)));
+        }
+
+        Current = end;
+        return value;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Uniform grid over the bounding box of the input. Points are bucketed by
+// a counting sort, so every cell is a contiguous slice of Points. TPoint is
+// any point with int X and Y.
+template <typename TPoint>
+struct TGrid
+{
+    static constexpr int PointsPerCell = 2;
+
+    TPoint Min;
+    int64_t CellWidth = 1;
+    int64_t CellHeight = 1;
+    int CellsX = 0;
+    int CellsY = 0;
+
+    // Points of the cell (x, y) are Points[CellStart[c], CellStart[c + 1]),
+    // where c = y * CellsX + x.
+    std::vector<int> CellStart;
+    std::vector<TPoint> Points;
+
+    int GetCellX(int x) const
+    {
+        return static_cast<int>(std::clamp<int64_t>((static_cast<int64_t>(x) - Min.X) / CellWidth, 0, CellsX - 1));
+    }
+
+    int GetCellY(int y) const
+    {
+        return static_cast<int>(std::clamp<int64_t>((static_cast<int64_t>(y) - Min.Y) / CellHeight, 0, CellsY - 1));
+    }
+
+    int GetCell(int cellX, int cellY) const
+    {
+        return cellY * CellsX + cellX;
+    }
+};
+
+template <typename TPoint>
+std::shared_ptr<TGrid<TPoint>> ConstructGrid(const std::vector<TPoint>& input)
+{
+    if (input.empty()) {
+        return {};
+    }
+
+    auto grid = std::make_shared<TGrid<TPoint>>();
+
+    TPoint max = input.front();
+    grid->Min = input.front();
+    for (const auto& point : input) {
+        grid->Min.X = std::min(grid->Min.X, point.X);
+        grid->Min.Y = std::min(grid->Min.Y, point.Y);
+        max.X = std::max(max.X, point.X);
+        max.Y = std::max(max.Y, point.Y);
+    }
+
+    // Square cells holding PointsPerCell points on average. If the box is
+    // thinner than such a cell, it is a single row or column of all the cells.
+    double width = static_cast<double>(max.X) - grid->Min.X + 1;
+    double height = static_cast<double>(max.Y) - grid->Min.Y + 1;
+    double cellsCount = std::max(1.0, static_cast<double>(std::ssize(input)) / TGrid<TPoint>::PointsPerCell);
+    double cellSide = std::sqrt(width * height / cellsCount);
+
+    double cellWidth = cellSide;
+    double cellHeight = cellSide;
+    if (cellSide > width) {
+        cellWidth = width;
+        cellHeight = height / cellsCount;
+    } else if (cellSide > height) {
+        cellWidth = width / cellsCount;
+        cellHeight = height;
+    }
+
+    grid->CellWidth = std::max<int64_t>(1, std::ceil(cellWidth));
+    grid->CellHeight = std::max<int64_t>(1, std::ceil(cellHeight));
+    grid->CellsX = static_cast<int>(std::ceil(width / static_cast<double>(grid->CellWidth)));
+    grid->CellsY = static_cast<int>(std::ceil(height / static_cast<double>(grid->CellHeight)));
+
+    std::vector<int> cells;
+    cells.reserve(input.size());
+
+    grid->CellStart.assign(grid->CellsX * grid->CellsY + 1, 0);
+    for (const auto& point : input) {
+        cells.push_back(grid->GetCell(grid->GetCellX(point.X), grid->GetCellY(point.Y)));
+        ++grid->CellStart[cells.back() + 1];
+    }
+
+    for (int i = 1; i < std::ssize(grid->CellStart); ++i) {
+        grid->CellStart[i] += grid->CellStart[i - 1];
+    }
+
+    std::vector<int> position(grid->CellStart.begin(), grid->CellStart.end() - 1);
+    grid->Points.resize(input.size());
+    for (int i = 0; i < std::ssize(input); ++i) {
+        grid->Points[position[cells[i]]++] = input[i];
+    }
+
+    return grid;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+template <typename TEvent>
+struct TTraceRecord
+{
+    // Index of the record plus one, published after the payload is written.
+    // Busy while a writer owns the slot.
+    std::atomic<uint64_t> Sequence = 0;
+    // Payload is atomic too, Dump may read it while a writer rewrites the slot.
+    std::atomic<TEvent> Event{};
+    std::array<std::atomic<int64_t>, 4> Arguments{};
+};
+
+// Keeps the last Capacity trace records of all threads. Writers claim slots
+// with a single fetch_add and never wait for each other, the oldest records are
+// overwritten. A writer which finds its slot owned by another one (possible only
+// if it was lapped by the whole ring) drops its record instead of tearing the
+// other one. Slots work like a seqlock: Dump reads the payload with relaxed
+// loads and keeps the record only if its sequence did not change meanwhile, so
+// it may run concurrently with writers and skips the slots being written. Each
+// program has its own TEvent enum with a ToString overload for the dump.
+template <typename TEvent>
+class TTraceRing
+{
+public:
+    static constexpr uint64_t Capacity = 1 << 16;
+    static constexpr uint64_t Busy = std::numeric_limits<uint64_t>::max();
+
+    // Arguments are integers only, a floating point value has to be scaled or
+    // bit cast by the caller instead of being truncated here.
+    template <typename... TArguments>
+        requires (sizeof...(TArguments) <= 4 && (std::is_integral_v<TArguments> && ...))
+    void Push(TEvent event, TArguments... arguments)
+    {
+        auto index = Head.fetch_add(1, std::memory_order_relaxed);
+        auto& record = Records[index % Capacity];
+
+        auto sequence = record.Sequence.load(std::memory_order_relaxed);
+        do {
+            if (sequence > index) {
+                return;
+            }
+        } while (!record.Sequence.compare_exchange_weak(sequence, Busy, std::memory_order_acquire, std::memory_order_relaxed));
+        // Dump which sees any of the payload stores below sees Busy afterwards.
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::array<int64_t, 4> values{static_cast<int64_t>(arguments)...};
+        record.Event.store(event, std::memory_order_relaxed);
+        for (size_t i = 0; i < values.size(); ++i) {
+            record.Arguments[i].store(values[i], std::memory_order_relaxed);
+        }
+        record.Sequence.store(index + 1, std::memory_order_release);
+    }
+
+    uint64_t GetCount() const
+    {
+        return Head.load(std::memory_order_relaxed);
+    }
+
+    // One record per line from the oldest one: index, event and arguments
+    // separated by tabs.
+    void Dump(std::ostream& output) const
+    {
+        auto head = Head.load(std::memory_order_acquire);
+        for (auto index = head > Capacity ? head - Capacity : 0; index < head; ++index) {
+            const auto& record = Records[index % Capacity];
+            if (record.Sequence.load(std::memory_order_acquire) != index + 1) {
+                continue;
+            }
+
+            auto event = record.Event.load(std::memory_order_relaxed);
+            std::array<int64_t, 4> arguments;
+            for (size_t i = 0; i < arguments.size(); ++i) {
+                arguments[i] = record.Arguments[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (record.Sequence.load(std::memory_order_relaxed) != index + 1) {
+                continue;
+            }
+
+            output << index << '\t' << ToString(event);
+            for (auto argument : arguments) {
+                output << '\t' << argument;
+            }
+            output << '\n';
+        }
+    }
+
+private:
+    std::unique_ptr<TTraceRecord<TEvent>[]> Records = std::make_unique<TTraceRecord<TEvent>[]>(Capacity);
+    std::atomic<uint64_t> Head = 0;
+};
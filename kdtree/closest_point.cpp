@@ -1,10 +1,26 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <charconv>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <cstdlib>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <queue>
+#include <random>
+#include <span>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
@@ -13,17 +29,89 @@
 #include <assert.h>
 #include <memory>
 #include <unordered_set>
+#include <utility>
 #include <cmath>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits>
 #include <queue>
 
+#include "../common/common.h"
+
 ////////////////////////////////////////////////////////////////////////////////////
 
-bool DebugIsDisabled = true;
+// Tracing is compiled in with -DTRACING_ENABLED=1. Otherwise TRACE expands to
+// nothing and its arguments are not evaluated, so there is no trace code left
+// in the hot loops.
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 0
+#endif
+
+enum class ETraceEvent : uint8_t
+{
+    // Leaf of the kd-tree: x, y.
+    LeafNode,
+    // Inner node split by x at the median point: x, y.
+    SplitX,
+    // Inner node split by y at the median point: x, y.
+    SplitY,
+    // Nearest neighbor query starts: x, y.
+    Query,
+    // Search checks the point of a leaf: x, y, squared distance.
+    CheckPoint,
+    // Search visits a node split by x: x.
+    VisitEdgeX,
+    // Search visits a node split by y: y.
+    VisitEdgeY,
+    // Grid is built: cells by x, cells by y, cell width, cell height.
+    GridCells,
+    // Grid search visits a ring of cells: ring.
+    GridRing,
+};
+
+std::string_view ToString(ETraceEvent event)
+{
+    switch (event) {
+        case ETraceEvent::LeafNode:
+            return "LeafNode";
+        case ETraceEvent::SplitX:
+            return "SplitX";
+        case ETraceEvent::SplitY:
+            return "SplitY";
+        case ETraceEvent::Query:
+            return "Query";
+        case ETraceEvent::CheckPoint:
+            return "CheckPoint";
+        case ETraceEvent::VisitEdgeX:
+            return "VisitEdgeX";
+        case ETraceEvent::VisitEdgeY:
+            return "VisitEdgeY";
+        case ETraceEvent::GridCells:
+            return "GridCells";
+        case ETraceEvent::GridRing:
+            return "GridRing";
+    }
+    return "Unknown";
+}
 
-#define debugStream \
-    if (DebugIsDisabled) {} \
-    else std::cerr
+#if TRACING_ENABLED
+TTraceRing<ETraceEvent> TraceRing;
+
+// Writes the trace to the file named by TRACE_OUTPUT, trace.tsv by default.
+void DumpTrace()
+{
+    const char* path = std::getenv("TRACE_OUTPUT");
+    std::ofstream output(path ? path : "trace.tsv");
+    TraceRing.Dump(output);
+}
+
+#define TRACE(event, ...) TraceRing.Push(ETraceEvent::event, __VA_ARGS__)
+#else
+#define TRACE(event, ...) static_cast<void>(0)
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////
 
@@ -48,6 +136,14 @@ double Distance(TPoint p1, TPoint p2)
     return std::sqrt(xdiff * xdiff + ydiff * ydiff);
 }
 
+int64_t SquaredDistance(TPoint p1, TPoint p2)
+{
+    int64_t xdiff = static_cast<int64_t>(p1.X) - p2.X;
+    int64_t ydiff = static_cast<int64_t>(p1.Y) - p2.Y;
+
+    return xdiff * xdiff + ydiff * ydiff;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 
 template <typename T>
@@ -178,7 +274,157 @@ void splitByPredicate(
     }
 }
 
-PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std::vector<TPoint>& orderedByY, int depth = 0)
+enum class ESplitStrategy
+{
+    // Alternate x and y by depth, split at the median point.
+    Alternate,
+    // Split the axis with the widest spread of points at the median point.
+    WidestSpread,
+    // Split the longest side of the cell in the middle. If all points are on
+    // one side, slide the split to the closest point.
+    SlidingMidpoint,
+    // Pick the split with the lowest expected query cost, see ChooseCostModelSplit.
+    CostModel,
+};
+
+struct TCell
+{
+    int LowerX = INT_MIN / 2;
+    int UpperX = INT_MAX / 2;
+    int LowerY = INT_MIN / 2;
+    int UpperY = INT_MAX / 2;
+};
+
+struct TSplit
+{
+    bool ByX = true;
+    // Points lower than median (TOrderByX or TOrderByY) go to the left subtree.
+    TPoint Median;
+};
+
+TSplit ChooseMedianSplit(const std::vector<TPoint>& orderedByX, const std::vector<TPoint>& orderedByY, bool byX)
+{
+    if (byX) {
+        return {.ByX = true, .Median = orderedByX[orderedByX.size() / 2]};
+    }
+    return {.ByX = false, .Median = orderedByY[orderedByY.size() / 2]};
+}
+
+TSplit ChooseSlidingMidpointSplit(const std::vector<TPoint>& orderedByX, const std::vector<TPoint>& orderedByY, TCell cell)
+{
+    int64_t spreadX = static_cast<int64_t>(orderedByX.back().X) - orderedByX.front().X;
+    int64_t spreadY = static_cast<int64_t>(orderedByY.back().Y) - orderedByY.front().Y;
+
+    if (spreadX == 0 && spreadY == 0) {
+        return ChooseMedianSplit(orderedByX, orderedByY, true);
+    }
+
+    bool byX = static_cast<int64_t>(cell.UpperX) - cell.LowerX >= static_cast<int64_t>(cell.UpperY) - cell.LowerY;
+    if (byX && spreadX == 0) {
+        byX = false;
+    } else if (!byX && spreadY == 0) {
+        byX = true;
+    }
+
+    // Both sides get at least one point: the lowest one is strictly lower than
+    // the split value, the highest one is not lower.
+    if (byX) {
+        auto value = std::clamp(std::midpoint(cell.LowerX, cell.UpperX), orderedByX.front().X + 1, orderedByX.back().X);
+        return {.ByX = true, .Median = {.X = value, .Y = INT_MIN}};
+    }
+
+    auto value = std::clamp(std::midpoint(cell.LowerY, cell.UpperY), orderedByY.front().Y + 1, orderedByY.back().Y);
+    return {.ByX = false, .Median = {.X = INT_MIN, .Y = value}};
+}
+
+// Query visits a subtree when the query circle intersects its bounding box, so
+// the probability is proportional to the area of the box grown by the query
+// radius. Radius is estimated from the density of the points in the node.
+// Only splits keeping at least a quarter of points on each side are considered
+// to bound the depth of the tree.
+TSplit ChooseCostModelSplit(const std::vector<TPoint>& orderedByX, const std::vector<TPoint>& orderedByY)
+{
+    auto size = std::ssize(orderedByX);
+
+    double width = static_cast<double>(orderedByX.back().X) - orderedByX.front().X + 1;
+    double height = static_cast<double>(orderedByY.back().Y) - orderedByY.front().Y + 1;
+    double diameter = 2 * std::sqrt(width * height / size);
+
+    std::optional<std::pair<double, TSplit>> best;
+
+    for (bool byX : {true, false}) {
+        const auto& ordered = byX ? orderedByX : orderedByY;
+
+        auto along = [byX] (const TPoint& point) {
+            return static_cast<double>(byX ? point.X : point.Y);
+        };
+        auto across = [byX] (const TPoint& point) {
+            return byX ? point.Y : point.X;
+        };
+
+        std::vector<std::pair<int, int>> prefix(size);
+        std::vector<std::pair<int, int>> suffix(size);
+
+        prefix.front() = {across(ordered.front()), across(ordered.front())};
+        for (int i = 1; i < size; ++i) {
+            prefix[i] = {std::min(prefix[i - 1].first, across(ordered[i])), std::max(prefix[i - 1].second, across(ordered[i]))};
+        }
+
+        suffix.back() = {across(ordered.back()), across(ordered.back())};
+        for (int i = size - 2; i >= 0; --i) {
+            suffix[i] = {std::min(suffix[i + 1].first, across(ordered[i])), std::max(suffix[i + 1].second, across(ordered[i]))};
+        }
+
+        for (auto i = std::max<int64_t>(1, size / 4); i <= std::max<int64_t>(1, 3 * size / 4); ++i) {
+            double lowerAlong = along(ordered[i - 1]) - along(ordered.front());
+            double lowerAcross = static_cast<double>(prefix[i - 1].second) - prefix[i - 1].first;
+            double upperAlong = along(ordered.back()) - along(ordered[i]);
+            double upperAcross = static_cast<double>(suffix[i].second) - suffix[i].first;
+
+            double cost = (lowerAlong + diameter) * (lowerAcross + diameter) * i
+                + (upperAlong + diameter) * (upperAcross + diameter) * (size - i);
+
+            if (!best || cost < best->first) {
+                best = {cost, TSplit{.ByX = byX, .Median = ordered[i]}};
+            }
+        }
+    }
+
+    return best->second;
+}
+
+TSplit ChooseSplit(
+    const std::vector<TPoint>& orderedByX,
+    const std::vector<TPoint>& orderedByY,
+    ESplitStrategy strategy,
+    TCell cell,
+    int depth)
+{
+    switch (strategy) {
+        case ESplitStrategy::Alternate:
+            return ChooseMedianSplit(orderedByX, orderedByY, depth % 2 == 0);
+        case ESplitStrategy::WidestSpread:
+            return ChooseMedianSplit(
+                orderedByX,
+                orderedByY,
+                static_cast<int64_t>(orderedByX.back().X) - orderedByX.front().X
+                    >= static_cast<int64_t>(orderedByY.back().Y) - orderedByY.front().Y);
+        case ESplitStrategy::SlidingMidpoint:
+            return ChooseSlidingMidpointSplit(orderedByX, orderedByY, cell);
+        case ESplitStrategy::CostModel:
+            return ChooseCostModelSplit(orderedByX, orderedByY);
+    }
+
+    assert(false);
+    return {};
+}
+
+PNode ConstructKdTreeRecursive(
+    const std::vector<TPoint>& orderedByX,
+    const std::vector<TPoint>& orderedByY,
+    ESplitStrategy strategy,
+    TCell cell,
+    int depth = 0)
 {
     assert(orderedByX.size() == orderedByY.size());
 
@@ -188,7 +434,7 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
     }
 
     if (orderedByX.size() == 1) {
-        debugStream << "leaf node: " << orderedByX.front() << std::endl;
+        TRACE(LeafNode, orderedByX.front().X, orderedByX.front().Y);
         return std::make_shared<TNode>(orderedByX.front().X, orderedByX.front().Y);
     }
 
@@ -202,23 +448,28 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
 
     std::function<bool (TPoint)> lowerThanMedian;
 
-    if (depth % 2 == 0) {
-        // Split by x
-        auto median = orderedByX[(orderedByX.size()) / 2];
+    auto lowerCell = cell;
+    auto upperCell = cell;
+
+    auto split = ChooseSplit(orderedByX, orderedByY, strategy, cell, depth);
+    auto median = split.Median;
 
-        debugStream << "x median " << median << std::endl;
+    if (split.ByX) {
+        TRACE(SplitX, median.X, median.Y);
 
         root->X = median.X;
+        lowerCell.UpperX = median.X;
+        upperCell.LowerX = median.X;
+
         lowerThanMedian = [median] (TPoint point) {
             return TOrderByX{}(point, median);
         };
     } else {
-        // Split by Y
-        auto median = orderedByY[orderedByY.size() / 2];
-
-        debugStream << "y median " << median << std::endl;
+        TRACE(SplitY, median.X, median.Y);
 
         root->Y = median.Y;
+        lowerCell.UpperY = median.Y;
+        upperCell.LowerY = median.Y;
 
         lowerThanMedian = [median] (TPoint point) {
             return TOrderByY{}(point, median);
@@ -228,21 +479,32 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
     splitByPredicate(orderedByX, lowerByX, upperByX, lowerThanMedian);
     splitByPredicate(orderedByY, lowerByY, upperByY, lowerThanMedian);
 
-    root->Left = ConstructKdTreeRecursive(lowerByX, lowerByY, depth + 1);
-    root->Right = ConstructKdTreeRecursive(upperByX, upperByY, depth + 1);
+    root->Left = ConstructKdTreeRecursive(lowerByX, lowerByY, strategy, lowerCell, depth + 1);
+    root->Right = ConstructKdTreeRecursive(upperByX, upperByY, strategy, upperCell, depth + 1);
 
     return root;
 }
 
-PNode ConstructKDTree(const std::vector<TPoint>& input)
+PNode ConstructKDTree(std::span<const TPoint> input, ESplitStrategy strategy = ESplitStrategy::Alternate)
 {
-    auto orderedByX = input;
+    if (input.empty()) {
+        return {};
+    }
+
+    std::vector<TPoint> orderedByX(input.begin(), input.end());
     std::sort(orderedByX.begin(), orderedByX.end(), TOrderByX{});
 
-    auto orderedByY = input;
+    std::vector<TPoint> orderedByY(input.begin(), input.end());
     std::sort(orderedByY.begin(), orderedByY.end(), TOrderByY{});
 
-    return ConstructKdTreeRecursive(orderedByX, orderedByY);
+    TCell cell {
+        .LowerX = orderedByX.front().X,
+        .UpperX = orderedByX.back().X,
+        .LowerY = orderedByY.front().Y,
+        .UpperY = orderedByY.back().Y,
+    };
+
+    return ConstructKdTreeRecursive(orderedByX, orderedByY, strategy, cell);
 }
 
 bool IsInRange(int value, int lower, int upper)
@@ -259,10 +521,17 @@ int GetClosestFromRange(int value, int lower, int upper)
     return std::abs(value - lower) < std::abs(value - upper) ? lower : upper;
 }
 
+struct TTraverseStats
+{
+    // Tree nodes or grid cells.
+    int64_t NodesVisited = 0;
+};
+
 void TraverseKDTree(
     PNode kdTree,
     TPoint thePoint,
-    std::optional<TDistancePair>& best)
+    std::optional<TDistancePair>& best,
+    TTraverseStats* stats = nullptr)
 {
     if (!kdTree) {
         return;
@@ -307,6 +576,10 @@ void TraverseKDTree(
         auto next = pq.top();
         pq.pop();
 
+        if (stats) {
+            ++stats->NodesVisited;
+        }
+
         const auto& node = next.Node;
 
         if (node->IsLeaf()) {
@@ -317,7 +590,7 @@ void TraverseKDTree(
                 .Point = point,
             };
 
-            debugStream << "traverse check node: " << point << std::endl;
+            TRACE(CheckPoint, point.X, point.Y, SquaredDistance(point, thePoint));
 
             if (!best || current < *best)
             {
@@ -343,12 +616,12 @@ void TraverseKDTree(
 
         if (node->X) {
             auto x = *node->X;
-            debugStream << "traverse visit x edge: " << x  << std::endl;
+            TRACE(VisitEdgeX, x);
             lower.UpperX = x; 
             upper.LowerX = x; 
         } else {
             auto y = *node->Y;
-            debugStream << "traverse visit y edge: " << y  << std::endl;
+            TRACE(VisitEdgeY, y);
 
             lower.UpperY = y; 
             upper.LowerY = y; 
@@ -359,18 +632,24 @@ void TraverseKDTree(
                 continue;
             }
 
+            if (best && Distance(child.Closest(thePoint), thePoint) > best->Distance) {
+                continue;
+            }
+
             child.SetDistance(thePoint);
             pq.push(child);
         }
     }
 }
 
-std::vector<TPoint> KDTree(const std::vector<TPoint>& input, const TPoint& thePoint)
+std::vector<TPoint> KDTree(
+    const std::vector<TPoint>& input,
+    const TPoint& thePoint,
+    ESplitStrategy strategy = ESplitStrategy::Alternate)
 {
-    auto kdTree = ConstructKDTree(input);
+    auto kdTree = ConstructKDTree(input, strategy);
 
-    // Separate construction and search.
-    debugStream << std::endl;
+    TRACE(Query, thePoint.X, thePoint.Y);
 
     std::optional<TDistancePair> best;
     TraverseKDTree(kdTree, thePoint, best);
@@ -382,6 +661,339 @@ std::vector<TPoint> KDTree(const std::vector<TPoint>& input, const TPoint& thePo
     return { best->Point };
 }
 
+// Nearest point queries for a stream of close query points, e.g. a moving object.
+// Answer to the previous query is a real candidate for the next one, so search
+// starts with a tight bound instead of an empty best.
+struct TQuerySession
+{
+    PNode KDTree;
+    // Answer to the previous query, valid if HasPrevious.
+    TPoint Previous;
+    bool HasPrevious = false;
+
+    explicit TQuerySession(PNode kdTree)
+        : KDTree(std::move(kdTree))
+    { }
+
+    std::optional<TDistancePair> Find(TPoint thePoint, TTraverseStats* stats = nullptr)
+    {
+        std::optional<TDistancePair> best;
+
+        if (HasPrevious) {
+            best = TDistancePair{
+                .Distance = Distance(Previous, thePoint),
+                .Point = Previous,
+            };
+        }
+
+        TraverseKDTree(KDTree, thePoint, best, stats);
+
+        if (best) {
+            Previous = best->Point;
+            HasPrevious = true;
+        }
+
+        return best;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Grid of the points, see TGrid in common.h.
+using PGrid = std::shared_ptr<TGrid<TPoint>>;
+
+void TraverseGrid(
+    const PGrid& grid,
+    TPoint thePoint,
+    std::optional<TDistancePair>& best,
+    TTraverseStats* stats = nullptr)
+{
+    if (!grid) {
+        return;
+    }
+
+    auto visitCell = [&] (int cellX, int cellY) {
+        auto cell = grid->GetCell(cellX, cellY);
+
+        if (stats) {
+            ++stats->NodesVisited;
+        }
+
+        for (int i = grid->CellStart[cell]; i < grid->CellStart[cell + 1]; ++i) {
+            TDistancePair current {
+                .Distance = Distance(grid->Points[i], thePoint),
+                .Point = grid->Points[i],
+            };
+
+            if (!best || current < *best) {
+                best = current;
+            }
+        }
+    };
+
+    auto centerX = grid->GetCellX(thePoint.X);
+    auto centerY = grid->GetCellY(thePoint.Y);
+    auto maxRing = std::max({centerX, grid->CellsX - 1 - centerX, centerY, grid->CellsY - 1 - centerY});
+
+    // Visit rings of cells around the cell of the point. Every cell of the ring r
+    // is at least (r - 1) cells away from the point (or its projection onto the grid).
+    for (int ring = 0; ring <= maxRing; ++ring) {
+        if (best && best->Distance < static_cast<double>(ring - 1) * std::min(grid->CellWidth, grid->CellHeight)) {
+            break;
+        }
+
+        TRACE(GridRing, ring);
+
+        for (int cellY = std::max(0, centerY - ring); cellY <= std::min(grid->CellsY - 1, centerY + ring); ++cellY) {
+            if (std::abs(cellY - centerY) == ring) {
+                for (int cellX = std::max(0, centerX - ring); cellX <= std::min(grid->CellsX - 1, centerX + ring); ++cellX) {
+                    visitCell(cellX, cellY);
+                }
+                continue;
+            }
+
+            if (centerX - ring >= 0) {
+                visitCell(centerX - ring, cellY);
+            }
+            if (centerX + ring < grid->CellsX) {
+                visitCell(centerX + ring, cellY);
+            }
+        }
+    }
+}
+
+std::vector<TPoint> Grid(const std::vector<TPoint>& input, const TPoint& thePoint)
+{
+    auto grid = ConstructGrid(input);
+    if (grid) {
+        TRACE(GridCells, grid->CellsX, grid->CellsY, grid->CellWidth, grid->CellHeight);
+    }
+
+    std::optional<TDistancePair> best;
+    TraverseGrid(grid, thePoint, best);
+
+    if (!best) {
+        return {};
+    }
+
+    return { best->Point };
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Holds current version of an index (kd-tree, grid, ...) which is rebuilt in the
+// background and published while readers keep querying it.
+//
+// Readers never lock: every reader owns a slot where it announces the epoch it
+// entered at, then reads the current pointer. Publish swaps the pointer, bumps
+// the global epoch and retires the old version. Retired version is destroyed
+// once every reader either left or entered after it was retired.
+//
+// At most MaxReaders readers exist at the same time, a slot is free again once
+// its reader is destroyed.
+template <typename T>
+class TSnapshotHolder
+{
+public:
+    static constexpr int MaxReaders = 128;
+
+    // Slot of a reader thread, the thread keeps it for all of its reads.
+    class TReader
+    {
+    public:
+        TReader(const TSnapshotHolder& holder, int slot)
+            : Holder(&holder)
+            , Slot(slot)
+        { }
+
+        TReader(TReader&& other)
+            : Holder(std::exchange(other.Holder, nullptr))
+            , Slot(other.Slot)
+        { }
+
+        ~TReader()
+        {
+            if (Holder) {
+                Holder->Readers[Slot].IsTaken.store(false, std::memory_order_release);
+            }
+        }
+
+        TReader(const TReader&) = delete;
+        TReader& operator=(const TReader&) = delete;
+        TReader& operator=(TReader&&) = delete;
+
+        template <typename TFunction>
+        auto Read(TFunction&& function) const
+        {
+            return Holder->Read(Slot, std::forward<TFunction>(function));
+        }
+
+    private:
+        const TSnapshotHolder* Holder;
+        int Slot;
+    };
+
+    explicit TSnapshotHolder(T value)
+        : Current(new T(std::move(value)))
+    { }
+
+    ~TSnapshotHolder()
+    {
+        delete Current.load();
+    }
+
+    TReader RegisterReader() const
+    {
+        for (int slot = 0; slot < MaxReaders; ++slot) {
+            bool isTaken = false;
+            if (Readers[slot].IsTaken.compare_exchange_strong(isTaken, true, std::memory_order_acquire)) {
+                return TReader(*this, slot);
+            }
+        }
+
+        throw std::runtime_error("Too many snapshot readers");
+    }
+
+    void Publish(T value)
+    {
+        std::lock_guard lock(WriterLock);
+
+        auto* previous = Current.exchange(new T(std::move(value)));
+
+        // Readers which announce a newer epoch will see the new value.
+        Retired.push_back({
+            .Epoch = Epoch.fetch_add(1),
+            .Value = std::unique_ptr<const T>(previous),
+        });
+
+        ReclaimRetired();
+    }
+
+    // Destroys retired versions which are not referenced by readers anymore.
+    // Returns number of versions still waiting for readers.
+    int Reclaim()
+    {
+        std::lock_guard lock(WriterLock);
+        return ReclaimRetired();
+    }
+
+private:
+    struct alignas(64) TReaderSlot
+    {
+        // Zero when reader is outside of Read.
+        std::atomic<uint64_t> Epoch = 0;
+        std::atomic<bool> IsTaken = false;
+    };
+
+    struct TRetired
+    {
+        uint64_t Epoch = 0;
+        std::unique_ptr<const T> Value;
+    };
+
+    std::atomic<const T*> Current = nullptr;
+    std::atomic<uint64_t> Epoch = 1;
+    // Readers announce epochs in a const holder.
+    mutable std::array<TReaderSlot, MaxReaders> Readers;
+
+    std::mutex WriterLock;
+    std::vector<TRetired> Retired;
+
+    template <typename TFunction>
+    auto Read(int slot, TFunction&& function) const
+    {
+        auto& reader = Readers[slot];
+
+        // Epoch must be announced before the pointer is loaded, both are seq_cst.
+        reader.Epoch.store(Epoch.load());
+
+        struct TExitGuard
+        {
+            TReaderSlot& Reader;
+
+            ~TExitGuard()
+            {
+                Reader.Epoch.store(0, std::memory_order_release);
+            }
+        } guard{reader};
+
+        return function(*Current.load());
+    }
+
+    // Requires WriterLock.
+    int ReclaimRetired()
+    {
+        auto oldestReader = std::numeric_limits<uint64_t>::max();
+        for (const auto& reader : Readers) {
+            auto epoch = reader.Epoch.load();
+            if (epoch != 0) {
+                oldestReader = std::min(oldestReader, epoch);
+            }
+        }
+
+        std::erase_if(Retired, [oldestReader] (const TRetired& retired) {
+            return retired.Epoch < oldestReader;
+        });
+
+        return std::ssize(Retired);
+    }
+};
+
+struct TPointIndex
+{
+    std::vector<TPoint> Input;
+    PNode KDTree;
+
+    explicit TPointIndex(std::vector<TPoint> input)
+        : Input(std::move(input))
+        , KDTree(ConstructKDTree(Input))
+    { }
+};
+
+using TConcurrentPointIndex = TSnapshotHolder<TPointIndex>;
+
+////////////////////////////////////////////////////////////////////////////////////
+
+static constexpr char PointsMagic[] = "POINTS01";
+
+// The points are valid while the file is mapped.
+std::span<const TPoint> MapPoints(const TMappedFile& file)
+{
+    return MapRecords<TPoint>(file, PointsMagic);
+}
+
+void WritePoints(const std::string& path, std::span<const TPoint> points)
+{
+    WriteRecords<TPoint>(path, points, PointsMagic);
+}
+
+// Two numbers per point: x and y.
+std::vector<TPoint> ParsePoints(std::string_view text)
+{
+    std::vector<TPoint> result;
+    TNumberParser<int> parser(text);
+
+    while (parser.SkipSpaces()) {
+        TPoint point;
+        point.X = parser.Next();
+        point.Y = parser.Next();
+        result.push_back(point);
+    }
+
+    return result;
+}
+
+// Points of the binary file are used in place, text is parsed into the buffer.
+std::span<const TPoint> LoadPoints(const TMappedFile& file, std::vector<TPoint>& buffer)
+{
+    if (IsBinary(file, PointsMagic)) {
+        return MapPoints(file);
+    }
+
+    buffer = ParsePoints(file.GetText());
+    return buffer;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 
 std::vector<TPoint> BruteForce(const std::vector<TPoint>& input, const TPoint& thePoint)
@@ -412,6 +1024,22 @@ struct TTestCase
     std::set<TPoint, TOrderByX> Output;
 };
 
+using TClosestSearch = std::function<std::vector<TPoint>(const std::vector<TPoint>&, const TPoint&)>;
+
+struct TClosestSearchEngine
+{
+    std::string Name;
+    TClosestSearch Search;
+};
+
+const std::vector<TClosestSearchEngine> ClosestSearchEngines = {
+    {"kdtree", [] (const auto& input, const auto& thePoint) { return KDTree(input, thePoint); }},
+    {"kdtree widest spread", [] (const auto& input, const auto& thePoint) { return KDTree(input, thePoint, ESplitStrategy::WidestSpread); }},
+    {"kdtree sliding midpoint", [] (const auto& input, const auto& thePoint) { return KDTree(input, thePoint, ESplitStrategy::SlidingMidpoint); }},
+    {"kdtree cost model", [] (const auto& input, const auto& thePoint) { return KDTree(input, thePoint, ESplitStrategy::CostModel); }},
+    {"grid", Grid},
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -426,9 +1054,9 @@ TPoint RandomPoint(int min, int max)
     return {.X = RandomInRange(min, max), .Y = RandomInRange(min, max)};
 }
 
-void CheckTestCase(const TTestCase& testCase)
+void CheckTestCase(const TTestCase& testCase, const TClosestSearchEngine& engine)
 {
-    auto results = KDTree(testCase.Input, testCase.ThePoint);
+    auto results = engine.Search(testCase.Input, testCase.ThePoint);
 
     std::set<TPoint, TOrderByX> indexed(results.begin(), results.end());
     bool failed = false;
@@ -453,6 +1081,7 @@ void CheckTestCase(const TTestCase& testCase)
     }
 
     if (failed) {
+        std::cout << "Engine: " << engine.Name << std::endl;
         std::cout << "Input: " << testCase.Input << std::endl;
         std::cout << "Expected output: " << testCase.Output << std::endl;
 
@@ -460,6 +1089,99 @@ void CheckTestCase(const TTestCase& testCase)
     }
 }
 
+void CheckTestCase(const TTestCase& testCase)
+{
+    for (const auto& engine : ClosestSearchEngines) {
+        CheckTestCase(testCase, engine);
+    }
+}
+
+// Concurrent writers leave the last Capacity records in order, none of them torn.
+// A writer preempted for the whole lap of the ring may drop its record. Dumps
+// taken while the writers are running skip the slots being written.
+bool TraceRingTest()
+{
+    static const int ThreadsCount = 4;
+    static const int64_t RecordsPerThread = TTraceRing<ETraceEvent>::Capacity / 2;
+
+    TTraceRing<ETraceEvent> ring;
+    std::atomic<int> runningCount = ThreadsCount;
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < ThreadsCount; ++thread) {
+        threads.emplace_back([&ring, &runningCount, thread] {
+            for (int64_t i = 0; i < RecordsPerThread; ++i) {
+                ring.Push(ETraceEvent::CheckPoint, thread, i, 2 * i, 3 * i);
+            }
+            --runningCount;
+        });
+    }
+
+    // Number of dumped records, or -1 if some record is torn or out of order.
+    auto checkDump = [&ring] (uint64_t minIndex) -> int64_t {
+        std::stringstream dump;
+        ring.Dump(dump);
+
+        int64_t recordsCount = 0;
+        std::string line;
+        while (std::getline(dump, line)) {
+            std::stringstream fields(line);
+            uint64_t index;
+            std::string event;
+            int64_t thread, i, doubled, tripled;
+            fields >> index >> event >> thread >> i >> doubled >> tripled;
+
+            if (index < minIndex || event != "CheckPoint" || doubled != 2 * i || tripled != 3 * i) {
+                return -1;
+            }
+            minIndex = index + 1;
+            ++recordsCount;
+        }
+        return recordsCount;
+    };
+
+    bool isTorn = false;
+    while (runningCount > 0) {
+        isTorn |= checkDump(0) < 0;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto recordsCount = checkDump(ring.GetCount() - TTraceRing<ETraceEvent>::Capacity);
+    return !isTorn && recordsCount >= static_cast<int64_t>(TTraceRing<ETraceEvent>::Capacity) - ThreadsCount;
+}
+
+bool LoaderTest()
+{
+    std::vector<TPoint> points{{-10, -10}, {0, 0}, {10, 20}};
+
+    auto path = (std::filesystem::temp_directory_path() / "points_loader_test.bin").string();
+    WritePoints(path, points);
+    TMappedFile file(path);
+    auto mapped = MapPoints(file);
+    std::filesystem::remove(path);
+
+    auto parsed = ParsePoints("-10 -10\n0\t0\r\n10 20\n");
+
+    // Size of the corrupt count wraps around to zero records, which is the
+    // size of the file.
+    bool rejectsCorrupt = false;
+    {
+        TBinaryHeader header {.Count = uint64_t(1) << 61};
+        std::memcpy(header.Magic, PointsMagic, sizeof(header.Magic));
+        std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(&header), sizeof(header));
+        TMappedFile corrupt(path);
+        try {
+            MapPoints(corrupt);
+        } catch (const std::runtime_error&) {
+            rejectsCorrupt = true;
+        }
+        std::filesystem::remove(path);
+    }
+
+    return std::equal(mapped.begin(), mapped.end(), points.begin(), points.end()) && parsed == points && rejectsCorrupt;
+}
+
 void StressTest()
 {
     static const int PointsCount = 1000;
@@ -478,12 +1200,549 @@ void StressTest()
     testCase.Output.insert(output.begin(), output.end());
 
     CheckTestCase(testCase);
+
+    // Point outside of the bounding box.
+    testCase.ThePoint = RandomPoint(-200, 300);
+
+    output = BruteForce(testCase.Input, testCase.ThePoint);
+    testCase.Output.clear();
+    testCase.Output.insert(output.begin(), output.end());
+
+    CheckTestCase(testCase);
+}
+
+std::vector<TPoint> RandomWalk(TPoint start, int count, int step)
+{
+    std::vector<TPoint> result = {start};
+    for (int i = 1; i < count; ++i) {
+        result.push_back({
+            .X = result.back().X + RandomInRange(-step, step + 1),
+            .Y = result.back().Y + RandomInRange(-step, step + 1),
+        });
+    }
+    return result;
+}
+
+void QuerySessionStressTest()
+{
+    static const int PointsCount = 1000;
+    static const int QueriesCount = 100;
+
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < PointsCount; ++i) {
+        index.insert(RandomPoint(0, 100));
+    }
+
+    std::vector<TPoint> input(index.begin(), index.end());
+    TQuerySession session(ConstructKDTree(input));
+
+    for (const auto& thePoint : RandomWalk(RandomPoint(0, 100), QueriesCount, 3)) {
+        auto expected = BruteForce(input, thePoint).front();
+        auto best = session.Find(thePoint);
+
+        if (!best || !(best->Point == expected)) {
+            std::cout << "Query session reported wrong point for: " << thePoint
+                << " expected: " << expected << std::endl;
+            std::cout << "Input: " << input << std::endl;
+
+            exit(-1);
+        }
+    }
+}
+
+std::vector<TPoint> UniquePoints(int count, int min, int max)
+{
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < count; ++i) {
+        index.insert(RandomPoint(min, max));
+    }
+    return {index.begin(), index.end()};
+}
+
+// Readers check every answer against BruteForce over the same snapshot while
+// writer keeps publishing new ones. Run under -fsanitize=thread to catch
+// reclamation of snapshots which are still read.
+void ConcurrentStressTest()
+{
+    static const int ReadersCount = 4;
+    static const int QueriesCount = 200;
+    static const int PublishCount = 20;
+    static const int PointsCount = 1000;
+
+    TConcurrentPointIndex index(TPointIndex(UniquePoints(PointsCount, 0, 100)));
+
+    std::vector<std::vector<TPoint>> updates;
+    std::vector<std::vector<TPoint>> queries;
+    for (int i = 0; i < PublishCount; ++i) {
+        updates.push_back(UniquePoints(PointsCount, 0, 100));
+    }
+    for (int i = 0; i < ReadersCount; ++i) {
+        queries.push_back(UniquePoints(QueriesCount, -10, 110));
+    }
+
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < ReadersCount; ++i) {
+        readers.emplace_back([&, i] {
+            auto reader = index.RegisterReader();
+
+            for (const auto& thePoint : queries[i]) {
+                reader.Read([&] (const TPointIndex& snapshot) {
+                    std::optional<TDistancePair> best;
+                    TraverseKDTree(snapshot.KDTree, thePoint, best);
+
+                    if (!best || !(best->Point == BruteForce(snapshot.Input, thePoint).front())) {
+                        ++failures;
+                    }
+                });
+            }
+        });
+    }
+
+    for (auto& update : updates) {
+        index.Publish(TPointIndex(std::move(update)));
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    if (failures > 0 || index.Reclaim() != 0) {
+        std::cout << "Concurrent index reported wrong points: " << failures << std::endl;
+        exit(-1);
+    }
+
+    // Slots of finished readers are reused, so short-lived reader threads do
+    // not run out of them.
+    for (int i = 0; i < 2 * TConcurrentPointIndex::MaxReaders; ++i) {
+        std::thread([&] {
+            index.RegisterReader().Read([] (const TPointIndex&) { });
+        }).join();
+    }
+
+    std::vector<TConcurrentPointIndex::TReader> held;
+    held.reserve(TConcurrentPointIndex::MaxReaders);
+    for (int i = 0; i < TConcurrentPointIndex::MaxReaders; ++i) {
+        held.emplace_back(index.RegisterReader());
+    }
+    try {
+        index.RegisterReader();
+        std::cout << "Concurrent index registered too many readers" << std::endl;
+        exit(-1);
+    } catch (const std::runtime_error&) {
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+int RandomInRange(std::mt19937_64& random, int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(random);
+}
+
+TPoint RandomPoint(std::mt19937_64& random, int min, int max)
+{
+    return {.X = RandomInRange(random, min, max), .Y = RandomInRange(random, min, max)};
+}
+
+// Points are unique, kd-tree construction does not support duplicates.
+std::vector<TPoint> RandomUniquePoints(std::mt19937_64& random, int count, int min, int max)
+{
+    std::vector<TPoint> result;
+    std::unordered_set<TPoint, TPointHash> index;
+
+    for (int i = 0; i < count; ++i) {
+        auto point = RandomPoint(random, min, max);
+        if (index.insert(point).second) {
+            result.push_back(point);
+        }
+    }
+
+    return result;
+}
+
+TTestCase GenerateFuzzCase(std::mt19937_64& random)
+{
+    auto maxValue = RandomInRange(random, 1, 100);
+
+    return {
+        .Input = RandomUniquePoints(random, RandomInRange(random, 1, 200), 0, maxValue),
+        .ThePoint = RandomPoint(random, -2 * maxValue, 3 * maxValue),
+    };
+}
+
+bool IsCorrect(const TTestCase& testCase)
+{
+    // There is no closest point to compare.
+    if (testCase.Input.empty()) {
+        return true;
+    }
+
+    auto expected = BruteForce(testCase.Input, testCase.ThePoint);
+
+    for (const auto& engine : ClosestSearchEngines) {
+        if (engine.Search(testCase.Input, testCase.ThePoint) != expected) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void PrintFuzzCase(const TTestCase& testCase)
+{
+    std::cout << "Input: " << testCase.Input << " point: " << testCase.ThePoint << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<TPoint> UniformPoints(int count, int maxValue)
+{
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < count; ++i) {
+        index.insert(RandomPoint(0, maxValue));
+    }
+    return {index.begin(), index.end()};
+}
+
+std::vector<TPoint> ClusteredPoints(int count, int maxValue)
+{
+    static const int ClustersCount = 20;
+
+    std::vector<TPoint> centers;
+    for (int i = 0; i < ClustersCount; ++i) {
+        centers.push_back(RandomPoint(0, maxValue));
+    }
+
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < count; ++i) {
+        const auto& center = centers[rand() % ClustersCount];
+        auto radius = maxValue / 100;
+        index.insert({
+            .X = center.X + RandomInRange(-radius, radius),
+            .Y = center.Y + RandomInRange(-radius, radius),
+        });
+    }
+    return {index.begin(), index.end()};
+}
+
+std::vector<TPoint> ElongatedPoints(int count, int maxValue)
+{
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < count; ++i) {
+        index.insert({.X = RandomInRange(0, maxValue), .Y = RandomInRange(0, maxValue / 100)});
+    }
+    return {index.begin(), index.end()};
+}
+
+template <typename TIndex, typename TTraverse>
+void BenchmarkQueries(
+    const std::string& name,
+    TIndex& index,
+    TTraverse traverse,
+    const std::vector<TPoint>& queries)
+{
+    double distances = 0;
+    TTraverseStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    for (const auto& query : queries) {
+        std::optional<TDistancePair> best;
+        traverse(index, query, best, &stats);
+        distances += best->Distance;
+    }
+
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+    std::cout << "    " << name
+        << ": " << elapsed.count() / queries.size() << " us/query"
+        << ", nodes visited: " << static_cast<double>(stats.NodesVisited) / queries.size() << " per query"
+        << ", total distance: " << distances
+        << std::endl;
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BenchmarkSnapshotSwaps(std::chrono::milliseconds swapPeriod)
+{
+    static const int PointsCount = 100000;
+    static const int MaxValue = 30000;
+    static const auto Duration = std::chrono::seconds(2);
+    static const int QueriesPerReader = 1 << 16;
+
+    auto readersCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+
+    // Queries are generated before the readers start, every reader by its own
+    // generator: rand() takes a lock, so readers would wait for each other.
+    std::vector<std::vector<TPoint>> queries(readersCount);
+    for (int i = 0; i < readersCount; ++i) {
+        std::mt19937_64 random(i + 1);
+        for (int query = 0; query < QueriesPerReader; ++query) {
+            queries[i].push_back(RandomPoint(random, 0, MaxValue));
+        }
+    }
+
+    TConcurrentPointIndex index(TPointIndex(UniformPoints(PointsCount, MaxValue)));
+    std::vector<std::vector<TPoint>> updates;
+    for (int i = 0; i < 10; ++i) {
+        updates.push_back(UniformPoints(PointsCount, MaxValue));
+    }
+
+    std::atomic<bool> stopped = false;
+    std::vector<std::vector<double>> latencies(readersCount);
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < readersCount; ++i) {
+        readers.emplace_back([&, i] {
+            auto reader = index.RegisterReader();
+
+            for (int query = 0; !stopped; ++query) {
+                auto thePoint = queries[i][query % QueriesPerReader];
+                auto start = std::chrono::steady_clock::now();
+
+                reader.Read([&] (const TPointIndex& snapshot) {
+                    std::optional<TDistancePair> best;
+                    TraverseKDTree(snapshot.KDTree, thePoint, best);
+                });
+
+                latencies[i].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+
+    int published = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < Duration) {
+        if (swapPeriod.count() == 0) {
+            std::this_thread::sleep_for(Duration);
+            continue;
+        }
+
+        std::this_thread::sleep_for(swapPeriod);
+        index.Publish(TPointIndex(updates[published++ % updates.size()]));
+    }
+
+    stopped = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    std::vector<double> all;
+    for (const auto& latency : latencies) {
+        all.insert(all.end(), latency.begin(), latency.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&] (double p) {
+        return all[std::min(std::ssize(all) - 1, static_cast<int64_t>(p * all.size()))];
+    };
+
+    std::cout << "    readers: " << readersCount
+        << ", swaps: " << published
+        << ", queries: " << all.size()
+        << ", p50: " << percentile(0.5) << " us"
+        << ", p99: " << percentile(0.99) << " us"
+        << ", p99.9: " << percentile(0.999) << " us"
+        << ", max: " << all.back() << " us"
+        << std::endl;
+}
+
+void BenchmarkLoaders(const std::vector<TPoint>& input)
+{
+    auto directory = std::filesystem::temp_directory_path();
+    auto binaryPath = (directory / "points_bench.bin").string();
+    auto textPath = (directory / "points_bench.txt").string();
+
+    WritePoints(binaryPath, input);
+    {
+        std::ofstream text(textPath);
+        for (const auto& point : input) {
+            text << point.X << ' ' << point.Y << '\n';
+        }
+    }
+
+    auto measure = [] (auto&& load) {
+        auto start = std::chrono::steady_clock::now();
+        auto count = load();
+        return std::make_pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), count);
+    };
+
+    // Summing coordinates touches every page of the mapping.
+    auto [mapped, mappedCount] = measure([&] {
+        TMappedFile file(binaryPath);
+        int64_t sum = 0;
+        for (const auto& point : MapPoints(file)) {
+            sum += point.X;
+        }
+        return MapPoints(file).size() + (sum < 0);
+    });
+    auto [parsed, parsedCount] = measure([&] {
+        TMappedFile file(textPath);
+        return ParsePoints(file.GetText()).size();
+    });
+    auto [streamed, streamedCount] = measure([&] {
+        std::ifstream text(textPath);
+        std::vector<TPoint> points;
+        TPoint point;
+        while (text >> point.X >> point.Y) {
+            points.push_back(point);
+        }
+        return points.size();
+    });
+    auto [construct, constructCount] = measure([&] {
+        TMappedFile file(binaryPath);
+        return ConstructKDTree(MapPoints(file)) ? MapPoints(file).size() : 0;
+    });
+
+    auto textSize = std::filesystem::file_size(textPath) / 1048576.0;
+    std::cout << "loaders, points: " << input.size()
+        << ", binary mmap: " << mapped << " s"
+        << ", text from_chars: " << parsed << " s (" << textSize / parsed << " MiB/s)"
+        << ", text iostream: " << streamed << " s (" << textSize / streamed << " MiB/s)"
+        << ", kd-tree straight from mmap: " << construct << " s"
+        << ", counts match: " << (mappedCount == parsedCount && parsedCount == streamedCount && streamedCount == constructCount)
+        << std::endl;
+
+    std::filesystem::remove(binaryPath);
+    std::filesystem::remove(textPath);
+}
+
+void Benchmark()
+{
+    static const int PointsCount = 1000000;
+    static const int QueriesCount = 10000;
+    static const int MaxValue = 30000;
+
+    BenchmarkLoaders(UniformPoints(PointsCount, MaxValue));
+
+    struct TDistribution
+    {
+        std::string Name;
+        std::function<std::vector<TPoint>(int, int)> Generate;
+    };
+
+    std::vector<TDistribution> distributions = {
+        {"uniform", UniformPoints},
+        {"clustered", ClusteredPoints},
+        {"elongated", ElongatedPoints},
+    };
+
+    std::vector<std::pair<std::string, ESplitStrategy>> strategies = {
+        {"kdtree", ESplitStrategy::Alternate},
+        {"kdtree widest spread", ESplitStrategy::WidestSpread},
+        {"kdtree sliding midpoint", ESplitStrategy::SlidingMidpoint},
+        {"kdtree cost model", ESplitStrategy::CostModel},
+    };
+
+    for (const auto& distribution : distributions) {
+        auto input = distribution.Generate(PointsCount, MaxValue);
+
+        std::vector<TPoint> queries;
+        for (int i = 0; i < QueriesCount; ++i) {
+            queries.push_back(input[rand() % input.size()]);
+            queries.back().X += RandomInRange(-100, 100);
+        }
+
+        std::cout << distribution.Name << ", points: " << input.size() << std::endl;
+
+        for (const auto& [name, strategy] : strategies) {
+            auto start = std::chrono::steady_clock::now();
+            auto kdTree = ConstructKDTree(input, strategy);
+            std::cout << "    " << name << " build: " << MillisecondsSince(start) << " ms" << std::endl;
+
+            BenchmarkQueries(name, kdTree, TraverseKDTree, queries);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto grid = ConstructGrid(input);
+        std::cout << "    grid build: " << MillisecondsSince(start) << " ms" << std::endl;
+
+        BenchmarkQueries("grid", grid, TraverseGrid, queries);
+
+        // Moving object: every query is close to the previous one.
+        auto walk = RandomWalk(input[rand() % input.size()], QueriesCount, 10);
+        auto kdTree = ConstructKDTree(input);
+
+        std::cout << "    random walk" << std::endl;
+        BenchmarkQueries("kdtree", kdTree, TraverseKDTree, walk);
+
+        TQuerySession session(kdTree);
+        auto sessionTraverse = [] (TQuerySession& session, TPoint thePoint, std::optional<TDistancePair>& best, TTraverseStats* stats) {
+            best = session.Find(thePoint, stats);
+        };
+        BenchmarkQueries("kdtree session", session, sessionTraverse, walk);
+    }
+
+    std::cout << "concurrent readers without swaps" << std::endl;
+    BenchmarkSnapshotSwaps(std::chrono::milliseconds(0));
+
+    std::cout << "concurrent readers with swaps every 50 ms" << std::endl;
+    BenchmarkSnapshotSwaps(std::chrono::milliseconds(50));
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-int main()
+// Finds the closest point of a binary or text file.
+int Closest(const std::string& path, TPoint thePoint)
 {
+    auto start = std::chrono::steady_clock::now();
+    TMappedFile file(path);
+    std::vector<TPoint> buffer;
+    auto input = LoadPoints(file, buffer);
+    auto load = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto kdTree = ConstructKDTree(input);
+    auto construct = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::optional<TDistancePair> best;
+    TraverseKDTree(kdTree, thePoint, best);
+
+    std::cout << "points: " << input.size();
+    if (best) {
+        std::cout << ", closest: " << best->Point;
+    }
+    std::cout << ", load: " << load << " s"
+        << ", kd-tree construction: " << construct << " s"
+        << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+#if TRACING_ENABLED
+    std::atexit(DumpTrace);
+#endif
+
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        Benchmark();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "fuzz") {
+        uint64_t seed = argc > 2 ? std::stoull(argv[2]) : 1;
+        int64_t casesCount = argc > 3 ? std::stoll(argv[3]) : 1000000;
+        int threadsCount = argc > 4 ? std::stoi(argv[4]) : 0;
+        return FuzzTest(seed, casesCount, threadsCount, GenerateFuzzCase, IsCorrect, PrintFuzzCase);
+    }
+
+    if (argc > 4 && std::string(argv[1]) == "closest") {
+        return Closest(argv[2], TPoint{std::stoi(argv[3]), std::stoi(argv[4])});
+    }
+
+    if (!LoaderTest()) {
+        std::cout << "Loaded points do not match!" << std::endl;
+        return 1;
+    }
+
+    if (!TraceRingTest()) {
+        std::cout << "Trace ring lost or tore records!" << std::endl;
+        return 1;
+    }
+
     std::vector<TTestCase> tests {
         {
             .Input = {{-10, -10}, {0, 0}, {10, 10}, {20, 20}},
@@ -505,5 +1764,13 @@ int main()
         StressTest();
     }
 
+    for (int i = 0; i < 100; ++i) {
+        QuerySessionStressTest();
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        ConcurrentStressTest();
+    }
+
     return 0;
 }
\ No newline at end of file
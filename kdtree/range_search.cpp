@@ -1,8 +1,23 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <cstdlib>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <random>
+#include <span>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
@@ -11,14 +26,86 @@
 #include <assert.h>
 #include <memory>
 #include <unordered_set>
+#include <limits.h>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/common.h"
 
 ////////////////////////////////////////////////////////////////////////////////////
 
-bool DebugIsDisabled = true;
+// Tracing is compiled in with -DTRACING_ENABLED=1. Otherwise TRACE expands to
+// nothing and its arguments are not evaluated, so there is no trace code left
+// in the hot loops.
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 0
+#endif
+
+enum class ETraceEvent : uint8_t
+{
+    // Leaf of the kd-tree: x, y.
+    LeafNode,
+    // Inner node split by x at the median point: x, y.
+    SplitX,
+    // Inner node split by y at the median point: x, y.
+    SplitY,
+    // Search checks the point of a leaf: x, y.
+    CheckPoint,
+    // Search visits a node split by x: x.
+    VisitEdgeX,
+    // Search visits a node split by y: y.
+    VisitEdgeY,
+    // Leaf of the range tree: x, y.
+    RangeTreeLeaf,
+    // Range tree node reported as a whole: min x, min y, max x, max y.
+    RangeTreeReport,
+    // Grid is built: cells by x, cells by y, cell width, cell height.
+    GridCells,
+};
+
+std::string_view ToString(ETraceEvent event)
+{
+    switch (event) {
+        case ETraceEvent::LeafNode:
+            return "LeafNode";
+        case ETraceEvent::SplitX:
+            return "SplitX";
+        case ETraceEvent::SplitY:
+            return "SplitY";
+        case ETraceEvent::CheckPoint:
+            return "CheckPoint";
+        case ETraceEvent::VisitEdgeX:
+            return "VisitEdgeX";
+        case ETraceEvent::VisitEdgeY:
+            return "VisitEdgeY";
+        case ETraceEvent::RangeTreeLeaf:
+            return "RangeTreeLeaf";
+        case ETraceEvent::RangeTreeReport:
+            return "RangeTreeReport";
+        case ETraceEvent::GridCells:
+            return "GridCells";
+    }
+    return "Unknown";
+}
 
-#define debugStream \
-    if (DebugIsDisabled) {} \
-    else std::cerr
+#if TRACING_ENABLED
+TTraceRing<ETraceEvent> TraceRing;
+
+// Writes the trace to the file named by TRACE_OUTPUT, trace.tsv by default.
+void DumpTrace()
+{
+    const char* path = std::getenv("TRACE_OUTPUT");
+    std::ofstream output(path ? path : "trace.tsv");
+    TraceRing.Dump(output);
+}
+
+#define TRACE(event, ...) TraceRing.Push(ETraceEvent::event, __VA_ARGS__)
+#else
+#define TRACE(event, ...) static_cast<void>(0)
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////
 
@@ -159,7 +246,7 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
     }
 
     if (orderedByX.size() == 1) {
-        debugStream << "leaf node: " << orderedByX.front() << std::endl;
+        TRACE(LeafNode, orderedByX.front().X, orderedByX.front().Y);
         return std::make_shared<TNode>(orderedByX.front().X, orderedByX.front().Y);
     }
 
@@ -177,7 +264,7 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
         // Split by x
         auto median = orderedByX[(orderedByX.size()) / 2];
 
-        debugStream << "x median " << median << std::endl;
+        TRACE(SplitX, median.X, median.Y);
 
         root->X = median.X;
         lowerThanMedian = [median] (TPoint point) {
@@ -187,7 +274,7 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
         // Split by Y
         auto median = orderedByY[orderedByY.size() / 2];
 
-        debugStream << "y median " << median << std::endl;
+        TRACE(SplitY, median.X, median.Y);
 
         root->Y = median.Y;
 
@@ -205,12 +292,12 @@ PNode ConstructKdTreeRecursive(const std::vector<TPoint>& orderedByX, const std:
     return root;
 }
 
-PNode ConstructKDTree(const std::vector<TPoint>& input)
+PNode ConstructKDTree(std::span<const TPoint> input)
 {
-    auto orderedByX = input;
+    std::vector<TPoint> orderedByX(input.begin(), input.end());
     std::sort(orderedByX.begin(), orderedByX.end(), TOrderByX{});
 
-    auto orderedByY = input;
+    std::vector<TPoint> orderedByY(input.begin(), input.end());
     std::sort(orderedByY.begin(), orderedByY.end(), TOrderByY{});
 
     return ConstructKdTreeRecursive(orderedByX, orderedByY);
@@ -230,7 +317,7 @@ void TraverseKDTree(PNode root, std::vector<TPoint>& results, TPoint lower, TPoi
     if (root->IsLeaf()) {
         auto point = TPoint{*root->X, *root->Y};
 
-        debugStream << "traverse check node: " << point << std::endl;
+        TRACE(CheckPoint, point.X, point.Y);
 
         if (IsInRange(point.X, lower.X, upper.X) && IsInRange(point.Y, lower.Y, upper.Y))
         {
@@ -242,7 +329,7 @@ void TraverseKDTree(PNode root, std::vector<TPoint>& results, TPoint lower, TPoi
     if (root->X) {
         auto x = *root->X;
 
-        debugStream << "traverse visit x edge: " << x  << std::endl;
+        TRACE(VisitEdgeX, x);
 
         if (x >= lower.X) {
             TraverseKDTree(root->Left, results, lower, upper);
@@ -252,7 +339,7 @@ void TraverseKDTree(PNode root, std::vector<TPoint>& results, TPoint lower, TPoi
         }
     } else {
         auto y = *root->Y;
-        debugStream << "traverse visit y edge: " << y  << std::endl;
+        TRACE(VisitEdgeY, y);
 
         if (y >= lower.Y) {
             TraverseKDTree(root->Left, results, lower, upper);
@@ -275,6 +362,688 @@ std::vector<TPoint> KDTree(const std::vector<TPoint>& input, const TPoint& lower
 
 ////////////////////////////////////////////////////////////////////////////////////
 
+// Flat kd-tree is just the array of points, without nodes and pointers: the
+// median of every range is in the middle of the range, points before it are not
+// greater and points after it are not less by the axis of the depth. Axes
+// alternate x, y. So the tree is written to a file and queried from the mapping
+// as is, and duplicates need no special care.
+
+bool IsLowerByAxis(const TPoint& left, const TPoint& right, int depth)
+{
+    return depth % 2 == 0 ? TOrderByX{}(left, right) : TOrderByY{}(left, right);
+}
+
+void BuildFlatKDTree(std::span<TPoint> points, int depth = 0)
+{
+    if (points.size() <= 1) {
+        return;
+    }
+
+    auto middle = points.size() / 2;
+    std::nth_element(points.begin(), points.begin() + middle, points.end(), [depth] (const TPoint& left, const TPoint& right) {
+        return IsLowerByAxis(left, right, depth);
+    });
+
+    BuildFlatKDTree(points.first(middle), depth + 1);
+    BuildFlatKDTree(points.subspan(middle + 1), depth + 1);
+}
+
+bool IsFlatKDTree(std::span<const TPoint> tree, int depth = 0)
+{
+    if (tree.size() <= 1) {
+        return true;
+    }
+
+    const auto& median = tree[tree.size() / 2];
+    auto lower = tree.first(tree.size() / 2);
+    auto upper = tree.subspan(tree.size() / 2 + 1);
+
+    return std::none_of(lower.begin(), lower.end(), [&] (const TPoint& point) { return IsLowerByAxis(median, point, depth); })
+        && std::none_of(upper.begin(), upper.end(), [&] (const TPoint& point) { return IsLowerByAxis(point, median, depth); })
+        && IsFlatKDTree(lower, depth + 1)
+        && IsFlatKDTree(upper, depth + 1);
+}
+
+void TraverseFlatKDTree(std::span<const TPoint> tree, std::vector<TPoint>& results, TPoint lower, TPoint upper, int depth = 0)
+{
+    if (tree.empty()) {
+        return;
+    }
+
+    auto middle = tree.size() / 2;
+    const auto& point = tree[middle];
+
+    if (IsInRange(point.X, lower.X, upper.X) && IsInRange(point.Y, lower.Y, upper.Y)) {
+        results.push_back(point);
+    }
+
+    auto value = depth % 2 == 0 ? point.X : point.Y;
+    if ((depth % 2 == 0 ? lower.X : lower.Y) <= value) {
+        TraverseFlatKDTree(tree.first(middle), results, lower, upper, depth + 1);
+    }
+    if (value <= (depth % 2 == 0 ? upper.X : upper.Y)) {
+        TraverseFlatKDTree(tree.subspan(middle + 1), results, lower, upper, depth + 1);
+    }
+}
+
+std::vector<TPoint> FlatKDTree(const std::vector<TPoint>& input, const TPoint& lower, const TPoint& upper)
+{
+    auto tree = input;
+    BuildFlatKDTree(tree);
+
+    std::vector<TPoint> results;
+    TraverseFlatKDTree(tree, results, lower, upper);
+
+    return results;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Layered range tree: primary tree is built over points ordered by X, every node
+// keeps its points ordered by Y together with bridges into children arrays
+// (fractional cascading). Query needs single binary search at the root, then
+// follows bridges, so it is O(log n + k) regardless of the query shape.
+
+struct TRangeNode;
+using PRangeNode = std::shared_ptr<TRangeNode>;
+
+struct TRangeNode
+{
+    // Smallest and largest points of the subtree in TOrderByX order.
+    TPoint Min;
+    TPoint Max;
+
+    std::vector<TPoint> ByY;
+
+    // For every position i in ByY (plus one past the end) contains position of
+    // the first point in child ByY which is not lower than ByY[i].
+    std::vector<int> LeftBridge;
+    std::vector<int> RightBridge;
+
+    PRangeNode Left;
+    PRangeNode Right;
+
+    bool IsLeaf() const
+    {
+        return !Left && !Right;
+    }
+};
+
+std::vector<int> MakeBridge(const std::vector<TPoint>& parent, const std::vector<TPoint>& child)
+{
+    std::vector<int> bridge;
+    bridge.reserve(parent.size() + 1);
+
+    int position = 0;
+    for (const auto& point : parent) {
+        while (position < std::ssize(child) && TOrderByY{}(child[position], point)) {
+            ++position;
+        }
+        bridge.push_back(position);
+    }
+    bridge.push_back(std::ssize(child));
+
+    return bridge;
+}
+
+PRangeNode ConstructRangeTreeRecursive(const std::vector<TPoint>& orderedByX, int begin, int end)
+{
+    if (begin == end) {
+        return {};
+    }
+
+    auto root = std::make_shared<TRangeNode>();
+    root->Min = orderedByX[begin];
+    root->Max = orderedByX[end - 1];
+
+    if (end - begin == 1) {
+        TRACE(RangeTreeLeaf, root->Min.X, root->Min.Y);
+        root->ByY = {orderedByX[begin]};
+        return root;
+    }
+
+    auto middle = begin + (end - begin) / 2;
+    root->Left = ConstructRangeTreeRecursive(orderedByX, begin, middle);
+    root->Right = ConstructRangeTreeRecursive(orderedByX, middle, end);
+
+    const auto& left = root->Left->ByY;
+    const auto& right = root->Right->ByY;
+
+    root->ByY.reserve(left.size() + right.size());
+    std::merge(left.begin(), left.end(), right.begin(), right.end(), std::back_inserter(root->ByY), TOrderByY{});
+
+    root->LeftBridge = MakeBridge(root->ByY, left);
+    root->RightBridge = MakeBridge(root->ByY, right);
+
+    return root;
+}
+
+PRangeNode ConstructRangeTree(const std::vector<TPoint>& input)
+{
+    auto orderedByX = input;
+    std::sort(orderedByX.begin(), orderedByX.end(), TOrderByX{});
+
+    return ConstructRangeTreeRecursive(orderedByX, 0, std::ssize(orderedByX));
+}
+
+void TraverseRangeTree(const PRangeNode& root, int position, std::vector<TPoint>& results, TPoint lower, TPoint upper)
+{
+    if (!root || position == std::ssize(root->ByY)) {
+        return;
+    }
+
+    if (root->Max.X < lower.X || root->Min.X > upper.X) {
+        return;
+    }
+
+    if (root->Min.X >= lower.X && root->Max.X <= upper.X) {
+        TRACE(RangeTreeReport, root->Min.X, root->Min.Y, root->Max.X, root->Max.Y);
+
+        for (int i = position; i < std::ssize(root->ByY) && root->ByY[i].Y <= upper.Y; ++i) {
+            results.push_back(root->ByY[i]);
+        }
+        return;
+    }
+
+    // Leaves are either completely inside or outside of the x range.
+    assert(!root->IsLeaf());
+
+    TraverseRangeTree(root->Left, root->LeftBridge[position], results, lower, upper);
+    TraverseRangeTree(root->Right, root->RightBridge[position], results, lower, upper);
+}
+
+void TraverseRangeTree(const PRangeNode& root, std::vector<TPoint>& results, TPoint lower, TPoint upper)
+{
+    if (!root || lower.Y > upper.Y) {
+        return;
+    }
+
+    auto start = std::lower_bound(
+        root->ByY.begin(),
+        root->ByY.end(),
+        TPoint{.X = INT_MIN, .Y = lower.Y},
+        TOrderByY{});
+
+    TraverseRangeTree(root, start - root->ByY.begin(), results, lower, upper);
+}
+
+std::vector<TPoint> RangeTree(const std::vector<TPoint>& input, const TPoint& lower, const TPoint& upper)
+{
+    auto rangeTree = ConstructRangeTree(input);
+
+    std::vector<TPoint> results;
+    TraverseRangeTree(rangeTree, results, lower, upper);
+
+    return results;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+// Grid of the points, see TGrid in common.h.
+using PGrid = std::shared_ptr<TGrid<TPoint>>;
+
+void TraverseGrid(const PGrid& grid, std::vector<TPoint>& results, TPoint lower, TPoint upper)
+{
+    if (!grid || lower.X > upper.X || lower.Y > upper.Y) {
+        return;
+    }
+
+    for (int cellY = grid->GetCellY(lower.Y); cellY <= grid->GetCellY(upper.Y); ++cellY) {
+        for (int cellX = grid->GetCellX(lower.X); cellX <= grid->GetCellX(upper.X); ++cellX) {
+            auto cell = grid->GetCell(cellX, cellY);
+
+            for (int i = grid->CellStart[cell]; i < grid->CellStart[cell + 1]; ++i) {
+                const auto& point = grid->Points[i];
+                if (IsInRange(point.X, lower.X, upper.X) && IsInRange(point.Y, lower.Y, upper.Y)) {
+                    results.push_back(point);
+                }
+            }
+        }
+    }
+}
+
+std::vector<TPoint> Grid(const std::vector<TPoint>& input, const TPoint& lower, const TPoint& upper)
+{
+    auto grid = ConstructGrid(input);
+    if (grid) {
+        TRACE(GridCells, grid->CellsX, grid->CellsY, grid->CellWidth, grid->CellHeight);
+    }
+
+    std::vector<TPoint> results;
+    TraverseGrid(grid, results, lower, upper);
+
+    return results;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+static constexpr char PointsMagic[] = "POINTS01";
+
+// The points are valid while the file is mapped.
+std::span<const TPoint> MapPoints(const TMappedFile& file)
+{
+    return MapRecords<TPoint>(file, PointsMagic);
+}
+
+void WritePoints(const std::string& path, std::span<const TPoint> points)
+{
+    WriteRecords<TPoint>(path, points, PointsMagic);
+}
+
+// Two numbers per point: x and y.
+std::vector<TPoint> ParsePoints(std::string_view text)
+{
+    std::vector<TPoint> result;
+    TNumberParser<int> parser(text);
+
+    while (parser.SkipSpaces()) {
+        TPoint point;
+        point.X = parser.Next();
+        point.Y = parser.Next();
+        result.push_back(point);
+    }
+
+    return result;
+}
+
+// Points of the binary file are used in place, text is parsed into the buffer.
+std::span<const TPoint> LoadPoints(const TMappedFile& file, std::vector<TPoint>& buffer)
+{
+    if (IsBinary(file, PointsMagic)) {
+        return MapPoints(file);
+    }
+
+    buffer = ParsePoints(file.GetText());
+    return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+static constexpr char FlatKDTreeMagic[] = "KDTREE01";
+
+// The tree is valid while the file is mapped.
+std::span<const TPoint> MapFlatKDTree(const TMappedFile& file)
+{
+    return MapRecords<TPoint>(file, FlatKDTreeMagic);
+}
+
+// Descriptor for positioned reads and writes, closed on destruction.
+struct TFile
+{
+    int Fd = -1;
+
+    explicit TFile(int fd)
+        : Fd(fd)
+    { }
+
+    TFile(const std::string& path, int flags)
+        : Fd(open(path.c_str(), flags, 0644))
+    {
+        if (Fd < 0) {
+            throw std::runtime_error("Can not open " + path);
+        }
+    }
+
+    // The file has no name, so the system removes it once it is closed.
+    static std::shared_ptr<TFile> MakeTemporary(const std::string& directory)
+    {
+        auto path = (std::filesystem::path(directory) / "kdtree_run_XXXXXX").string();
+        auto fd = mkstemp(path.data());
+        if (fd < 0) {
+            throw std::runtime_error("Can not create a temporary file in " + directory);
+        }
+        unlink(path.c_str());
+        return std::make_shared<TFile>(fd);
+    }
+
+    ~TFile()
+    {
+        if (Fd >= 0) {
+            close(Fd);
+        }
+    }
+
+    TFile(const TFile&) = delete;
+    TFile& operator=(const TFile&) = delete;
+
+    void Read(void* data, size_t size, uint64_t offset) const
+    {
+        auto* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            auto count = pread(Fd, bytes, size, offset);
+            if (count <= 0) {
+                throw std::runtime_error("Can not read the file");
+            }
+            bytes += count;
+            size -= count;
+            offset += count;
+        }
+    }
+
+    void Write(const void* data, size_t size, uint64_t offset)
+    {
+        const auto* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            auto count = pwrite(Fd, bytes, size, offset);
+            if (count <= 0) {
+                throw std::runtime_error("Can not write the file");
+            }
+            bytes += count;
+            size -= count;
+            offset += count;
+        }
+    }
+};
+
+// Points stored one after another in a file.
+struct TPointsRun
+{
+    std::shared_ptr<TFile> File;
+    uint64_t Offset = 0;
+    uint64_t Count = 0;
+};
+
+struct TExternalBuildOptions
+{
+    // Points, buffers and samples never take more.
+    size_t MemoryBytes = 64 << 20;
+    std::string TemporaryDirectory = std::filesystem::temp_directory_path().string();
+    uint64_t Seed = 1;
+};
+
+struct TExternalBuildStats
+{
+    uint64_t PointsCount = 0;
+    uint64_t BytesRead = 0;
+    uint64_t BytesWritten = 0;
+    // Ranges split on disk and ranges built in memory.
+    int64_t Partitions = 0;
+    int64_t MemoryBuilds = 0;
+    // Passes over runs to select medians.
+    int64_t SelectionPasses = 0;
+};
+
+// Builds the flat kd-tree of a points file larger than the memory. Ranges which
+// do not fit are split on disk: the median by the axis of the depth is selected
+// by sampling, the median is written right to its place in the output and the
+// rest is partitioned into two runs in temporary files. Ranges which fit are
+// read, built by BuildFlatKDTree and written to their place. All buffers are
+// parts of one block of MemoryBytes: half of it is the sample, a quarter is the
+// read buffer and the rest is two write buffers.
+struct TExternalKDTreeBuilder
+{
+    static constexpr size_t MinMemoryBytes = 16 << 10;
+    // Standard deviations of the sample rank kept around the median rank.
+    static constexpr double SampleMargin = 3;
+
+    struct TRunWriter
+    {
+        TPointsRun Run;
+        std::span<TPoint> Buffer;
+        size_t Size = 0;
+        uint64_t* BytesWritten = nullptr;
+
+        void Push(const TPoint& point)
+        {
+            Buffer[Size++] = point;
+            if (Size == Buffer.size()) {
+                Flush();
+            }
+        }
+
+        void Flush()
+        {
+            Run.File->Write(Buffer.data(), Size * sizeof(TPoint), Run.Offset + Run.Count * sizeof(TPoint));
+            Run.Count += Size;
+            *BytesWritten += Size * sizeof(TPoint);
+            Size = 0;
+        }
+    };
+
+    TExternalBuildOptions Options;
+    TExternalBuildStats Stats;
+    std::vector<TPoint> Memory;
+    std::span<TPoint> Sample;
+    std::span<TPoint> ReadBuffer;
+    std::span<TPoint> LowerBuffer;
+    std::span<TPoint> UpperBuffer;
+    std::mt19937_64 Random;
+    std::unique_ptr<TFile> Output;
+
+    explicit TExternalKDTreeBuilder(TExternalBuildOptions options)
+        : Options(std::move(options))
+        , Random(Options.Seed)
+    {
+        Verify(Options.MemoryBytes >= MinMemoryBytes);
+
+        Memory.resize(Options.MemoryBytes / sizeof(TPoint));
+        std::span<TPoint> memory(Memory);
+        auto half = memory.size() / 2;
+        auto quarter = memory.size() / 4;
+        auto eighth = memory.size() / 8;
+
+        Sample = memory.first(half);
+        ReadBuffer = memory.subspan(half, quarter);
+        LowerBuffer = memory.subspan(half + quarter, eighth);
+        UpperBuffer = memory.subspan(half + quarter + eighth, eighth);
+    }
+
+    void Build(const std::string& inputPath, const std::string& outputPath)
+    {
+        auto input = std::make_shared<TFile>(inputPath, O_RDONLY);
+        TBinaryHeader header;
+        input->Read(&header, sizeof(header), 0);
+        Verify(std::memcmp(header.Magic, PointsMagic, sizeof(header.Magic)) == 0);
+        Verify(IsValidCount<TPoint>(header, std::filesystem::file_size(inputPath)));
+
+        Output = std::make_unique<TFile>(outputPath, O_WRONLY | O_CREAT | O_TRUNC);
+        TBinaryHeader outputHeader {.Count = header.Count};
+        std::memcpy(outputHeader.Magic, FlatKDTreeMagic, sizeof(outputHeader.Magic));
+        Output->Write(&outputHeader, sizeof(outputHeader), 0);
+
+        Stats.PointsCount = header.Count;
+        BuildRange({.File = std::move(input), .Offset = sizeof(header), .Count = header.Count}, 0, 0);
+        Output.reset();
+    }
+
+    // Builds the subtree of the run points into the output from the position begin.
+    void BuildRange(TPointsRun run, uint64_t begin, int depth)
+    {
+        if (run.Count == 0) {
+            return;
+        }
+
+        if (run.Count <= Memory.size()) {
+            ++Stats.MemoryBuilds;
+            std::span<TPoint> points(Memory.data(), run.Count);
+            run.File->Read(points.data(), points.size_bytes(), run.Offset);
+            Stats.BytesRead += points.size_bytes();
+            run = {};
+
+            BuildFlatKDTree(points, depth);
+            WriteTree(points, begin);
+            return;
+        }
+
+        ++Stats.Partitions;
+        auto isLower = [depth] (const TPoint& left, const TPoint& right) {
+            return IsLowerByAxis(left, right, depth);
+        };
+
+        auto middle = run.Count / 2;
+        auto [median, lowerCount] = SelectPoint(run, middle, isLower);
+
+        // Points equal to the median fill the lower run up to the middle, the
+        // next one of them is the median itself.
+        TRunWriter lower {.Run = {.File = TFile::MakeTemporary(Options.TemporaryDirectory)}, .Buffer = LowerBuffer, .BytesWritten = &Stats.BytesWritten};
+        TRunWriter upper {.Run = {.File = TFile::MakeTemporary(Options.TemporaryDirectory)}, .Buffer = UpperBuffer, .BytesWritten = &Stats.BytesWritten};
+        auto equalToLower = middle - lowerCount;
+        bool isMedianPlaced = false;
+
+        ReadRun(run, [&] (std::span<const TPoint> points) {
+            for (const auto& point : points) {
+                if (isLower(point, median)) {
+                    lower.Push(point);
+                } else if (isLower(median, point)) {
+                    upper.Push(point);
+                } else if (equalToLower > 0) {
+                    --equalToLower;
+                    lower.Push(point);
+                } else if (!isMedianPlaced) {
+                    isMedianPlaced = true;
+                } else {
+                    upper.Push(point);
+                }
+            }
+        });
+        lower.Flush();
+        upper.Flush();
+        run = {};
+
+        Verify(isMedianPlaced && lower.Run.Count == middle);
+        WriteTree(std::span<const TPoint>(&median, 1), begin + middle);
+
+        BuildRange(std::move(lower.Run), begin, depth + 1);
+        BuildRange(std::move(upper.Run), begin + middle + 1, depth + 1);
+    }
+
+    // Point of the rank in the order and the number of points lower than it.
+    // Every pass over the run counts points below and equal to the bounds of the
+    // interval holding the rank and keeps a uniform sample (reservoir) of points
+    // strictly inside of it. Sample points around the rank bound the next
+    // interval, which is strictly narrower. Once all points inside of the interval
+    // fit in the sample, the point is selected in memory. If the rank escapes the
+    // interval, which is unlikely, the previous interval is sampled again with a
+    // wider margin.
+    template <class TIsLower>
+    std::pair<TPoint, uint64_t> SelectPoint(const TPointsRun& run, uint64_t rank, TIsLower&& isLower)
+    {
+        struct TInterval
+        {
+            std::optional<TPoint> Low;
+            std::optional<TPoint> High;
+        };
+
+        TInterval interval;
+        TInterval previous;
+        double margin = SampleMargin;
+
+        while (true) {
+            ++Stats.SelectionPasses;
+
+            uint64_t belowCount = 0;
+            uint64_t lowCount = 0;
+            uint64_t insideCount = 0;
+            uint64_t highCount = 0;
+
+            const auto& [low, high] = interval;
+            ReadRun(run, [&] (std::span<const TPoint> points) {
+                for (const auto& point : points) {
+                    if (low && isLower(point, *low)) {
+                        ++belowCount;
+                    } else if (low && !isLower(*low, point)) {
+                        ++lowCount;
+                    } else if (high && !isLower(point, *high)) {
+                        highCount += !isLower(*high, point);
+                    } else {
+                        if (insideCount < Sample.size()) {
+                            Sample[insideCount] = point;
+                        } else if (auto index = std::uniform_int_distribution<uint64_t>(0, insideCount)(Random); index < Sample.size()) {
+                            Sample[index] = point;
+                        }
+                        ++insideCount;
+                    }
+                }
+            });
+
+            if (rank < belowCount || rank >= belowCount + lowCount + insideCount + highCount) {
+                interval = previous;
+                margin *= 2;
+                continue;
+            }
+            if (rank < belowCount + lowCount) {
+                return {*low, belowCount};
+            }
+            if (rank >= belowCount + lowCount + insideCount) {
+                return {*high, belowCount + lowCount + insideCount};
+            }
+
+            auto insideRank = rank - belowCount - lowCount;
+            auto sample = Sample.first(std::min<uint64_t>(insideCount, Sample.size()));
+
+            if (insideCount <= Sample.size()) {
+                std::nth_element(sample.begin(), sample.begin() + insideRank, sample.end(), isLower);
+                auto point = sample[insideRank];
+                auto lowerInside = std::count_if(sample.begin(), sample.begin() + insideRank, [&] (const TPoint& other) {
+                    return isLower(other, point);
+                });
+                return {point, belowCount + lowCount + lowerInside};
+            }
+
+            std::sort(sample.begin(), sample.end(), isLower);
+            auto position = static_cast<double>(insideRank) / insideCount * sample.size();
+            auto deviation = margin * std::sqrt(static_cast<double>(sample.size())) / 2 + 1;
+
+            previous = interval;
+            if (auto index = std::floor(position - deviation); index >= 0) {
+                interval.Low = sample[static_cast<size_t>(index)];
+            }
+            if (auto index = std::ceil(position + deviation); index < static_cast<double>(sample.size())) {
+                interval.High = sample[static_cast<size_t>(index)];
+            }
+            margin = SampleMargin;
+        }
+    }
+
+    // Calls callback(points) for consecutive chunks of the run.
+    template <class TCallback>
+    void ReadRun(const TPointsRun& run, TCallback&& callback)
+    {
+        for (uint64_t done = 0; done < run.Count;) {
+            auto count = std::min<uint64_t>(ReadBuffer.size(), run.Count - done);
+            run.File->Read(ReadBuffer.data(), count * sizeof(TPoint), run.Offset + done * sizeof(TPoint));
+            Stats.BytesRead += count * sizeof(TPoint);
+
+            callback(std::span<const TPoint>(ReadBuffer.data(), count));
+            done += count;
+        }
+    }
+
+    void WriteTree(std::span<const TPoint> points, uint64_t position)
+    {
+        Output->Write(points.data(), points.size_bytes(), sizeof(TBinaryHeader) + position * sizeof(TPoint));
+        Stats.BytesWritten += points.size_bytes();
+    }
+};
+
+TExternalBuildStats BuildExternalKDTree(const std::string& inputPath, const std::string& outputPath, TExternalBuildOptions options = {})
+{
+    TExternalKDTreeBuilder builder(std::move(options));
+    builder.Build(inputPath, outputPath);
+    return builder.Stats;
+}
+
+// High water mark of the resident memory since the last ResetPeakMemory.
+int64_t PeakMemoryKiB()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmHWM:")) {
+            return std::stoll(line.substr(std::strlen("VmHWM:")));
+        }
+    }
+    return 0;
+}
+
+// Linux resets the high water mark of the process when 5 is written to clear_refs.
+void ResetPeakMemory()
+{
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
 std::vector<TPoint> BruteForce(const std::vector<TPoint>& input, const TPoint& lower, const TPoint& upper)
 {
     std::vector<TPoint> result;
@@ -296,6 +1065,21 @@ struct TTestCase
     std::set<TPoint, TOrderByX> Output;
 };
 
+using TRangeSearch = std::function<std::vector<TPoint>(const std::vector<TPoint>&, const TPoint&, const TPoint&)>;
+
+struct TRangeSearchEngine
+{
+    std::string Name;
+    TRangeSearch Search;
+};
+
+const std::vector<TRangeSearchEngine> RangeSearchEngines = {
+    {"kdtree", KDTree},
+    {"flat kdtree", FlatKDTree},
+    {"rangetree", RangeTree},
+    {"grid", Grid},
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -310,9 +1094,9 @@ TPoint RandomPoint(int min, int max)
     return {.X = RandomInRange(min, max), .Y = RandomInRange(min, max)};
 }
 
-void CheckTestCase(const TTestCase& testCase)
+void CheckTestCase(const TTestCase& testCase, const TRangeSearchEngine& engine)
 {
-    auto results = KDTree(testCase.Input, testCase.Lower, testCase.Upper);
+    auto results = engine.Search(testCase.Input, testCase.Lower, testCase.Upper);
     std::set<TPoint, TOrderByX> indexed(results.begin(), results.end());
     bool failed = false;
 
@@ -336,6 +1120,7 @@ void CheckTestCase(const TTestCase& testCase)
     }
 
     if (failed) {
+        std::cout << "Engine: " << engine.Name << std::endl;
         std::cout << "Input: " << testCase.Input << std::endl;
         std::cout << "Expected output: " << testCase.Output << std::endl;
 
@@ -343,6 +1128,226 @@ void CheckTestCase(const TTestCase& testCase)
     }
 }
 
+void CheckTestCase(const TTestCase& testCase)
+{
+    for (const auto& engine : RangeSearchEngines) {
+        CheckTestCase(testCase, engine);
+    }
+}
+
+// Concurrent writers leave the last Capacity records in order, none of them torn.
+// A writer preempted for the whole lap of the ring may drop its record. Dumps
+// taken while the writers are running skip the slots being written.
+bool TraceRingTest()
+{
+    static const int ThreadsCount = 4;
+    static const int64_t RecordsPerThread = TTraceRing<ETraceEvent>::Capacity / 2;
+
+    TTraceRing<ETraceEvent> ring;
+    std::atomic<int> runningCount = ThreadsCount;
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < ThreadsCount; ++thread) {
+        threads.emplace_back([&ring, &runningCount, thread] {
+            for (int64_t i = 0; i < RecordsPerThread; ++i) {
+                ring.Push(ETraceEvent::CheckPoint, thread, i, 2 * i, 3 * i);
+            }
+            --runningCount;
+        });
+    }
+
+    // Number of dumped records, or -1 if some record is torn or out of order.
+    auto checkDump = [&ring] (uint64_t minIndex) -> int64_t {
+        std::stringstream dump;
+        ring.Dump(dump);
+
+        int64_t recordsCount = 0;
+        std::string line;
+        while (std::getline(dump, line)) {
+            std::stringstream fields(line);
+            uint64_t index;
+            std::string event;
+            int64_t thread, i, doubled, tripled;
+            fields >> index >> event >> thread >> i >> doubled >> tripled;
+
+            if (index < minIndex || event != "CheckPoint" || doubled != 2 * i || tripled != 3 * i) {
+                return -1;
+            }
+            minIndex = index + 1;
+            ++recordsCount;
+        }
+        return recordsCount;
+    };
+
+    bool isTorn = false;
+    while (runningCount > 0) {
+        isTorn |= checkDump(0) < 0;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto recordsCount = checkDump(ring.GetCount() - TTraceRing<ETraceEvent>::Capacity);
+    return !isTorn && recordsCount >= static_cast<int64_t>(TTraceRing<ETraceEvent>::Capacity) - ThreadsCount;
+}
+
+bool LoaderTest()
+{
+    std::vector<TPoint> points{{-10, -10}, {0, 0}, {10, 20}};
+
+    auto path = (std::filesystem::temp_directory_path() / "points_loader_test.bin").string();
+    WritePoints(path, points);
+    TMappedFile file(path);
+    auto mapped = MapPoints(file);
+    std::filesystem::remove(path);
+
+    auto parsed = ParsePoints("-10 -10\n0\t0\r\n10 20\n");
+
+    // Size of the corrupt count wraps around to zero records, which is the
+    // size of the file.
+    bool rejectsCorrupt = false;
+    {
+        TBinaryHeader header {.Count = uint64_t(1) << 61};
+        std::memcpy(header.Magic, PointsMagic, sizeof(header.Magic));
+        std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(&header), sizeof(header));
+        TMappedFile corrupt(path);
+        try {
+            MapPoints(corrupt);
+        } catch (const std::runtime_error&) {
+            rejectsCorrupt = true;
+        }
+        std::filesystem::remove(path);
+    }
+
+    return std::equal(mapped.begin(), mapped.end(), points.begin(), points.end()) && parsed == points && rejectsCorrupt;
+}
+
+// Grid of a thin box is a single row or column of cells, and cells of the
+// points and queries spanning the whole int range are found without overflows.
+bool DegenerateGridTest()
+{
+    static const int PointsCount = 10;
+    static const int Min = std::numeric_limits<int>::min();
+    static const int Max = std::numeric_limits<int>::max();
+
+    std::vector<TPoint> column;
+    std::vector<TPoint> row;
+    for (int i = 0; i < PointsCount; ++i) {
+        auto coordinate = static_cast<int>(Min + (static_cast<int64_t>(Max) - Min) / (PointsCount - 1) * i);
+        column.push_back({.X = 0, .Y = coordinate});
+        row.push_back({.X = coordinate, .Y = 0});
+    }
+
+    for (const auto& input : {column, row}) {
+        auto grid = ConstructGrid(input);
+        if (grid->CellsX * grid->CellsY > PointsCount / TGrid<TPoint>::PointsPerCell) {
+            return false;
+        }
+    }
+
+    // Cells of the dense cluster are narrower than one, so the query reaching
+    // the far end of the int range is billions of cells away from it.
+    std::vector<TPoint> cluster;
+    for (int i = 0; i < PointsCount * PointsCount; ++i) {
+        cluster.push_back({.X = Min + i % 5, .Y = Min + i / 5 % 5});
+    }
+    if (std::ssize(Grid(cluster, {Min, Min}, {Max, Max})) != std::ssize(cluster)) {
+        return false;
+    }
+
+    std::mt19937_64 random(1);
+    auto randomPoint = [&random] {
+        std::uniform_int_distribution<int> coordinate(Min, Max);
+        return TPoint{.X = coordinate(random), .Y = coordinate(random)};
+    };
+    std::vector<TPoint> corners{{Min, Min}, {Min, Max}, {Max, Min}, {Max, Max}, {0, 0}};
+    for (int i = 0; i < 100; ++i) {
+        auto input = corners;
+        for (int j = 0; j < 100; ++j) {
+            input.push_back(randomPoint());
+        }
+
+        auto lower = randomPoint();
+        auto upper = randomPoint();
+        if (lower.X > upper.X) {
+            std::swap(lower.X, upper.X);
+        }
+        if (lower.Y > upper.Y) {
+            std::swap(lower.Y, upper.Y);
+        }
+
+        for (const auto& [queryLower, queryUpper] : {std::pair{lower, upper}, std::pair{TPoint{Min, Min}, TPoint{Max, Max}}}) {
+            auto results = Grid(input, queryLower, queryUpper);
+            auto expected = BruteForce(input, queryLower, queryUpper);
+            std::sort(results.begin(), results.end(), TOrderByX());
+            std::sort(expected.begin(), expected.end(), TOrderByX());
+            if (results != expected) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Budget of the external build is tiny, so the tree is partitioned on disk many
+// times, also with many duplicates of the split coordinates.
+bool ExternalBuildTest()
+{
+    static const int PointsCount = 50000;
+
+    std::mt19937_64 random(1);
+    for (int maxValue : {1000, 20}) {
+        std::vector<TPoint> points(PointsCount);
+        for (auto& point : points) {
+            point = {
+                .X = std::uniform_int_distribution<int>(0, maxValue)(random),
+                .Y = std::uniform_int_distribution<int>(0, maxValue)(random),
+            };
+        }
+
+        auto directory = std::filesystem::temp_directory_path();
+        auto pointsPath = (directory / "external_build_test.bin").string();
+        auto treePath = (directory / "external_build_test.kdtree").string();
+        WritePoints(pointsPath, points);
+        auto stats = BuildExternalKDTree(pointsPath, treePath, {.MemoryBytes = TExternalKDTreeBuilder::MinMemoryBytes});
+
+        TMappedFile file(treePath);
+        auto tree = MapFlatKDTree(file);
+        std::vector<TPoint> sorted(tree.begin(), tree.end());
+        std::filesystem::remove(pointsPath);
+        std::filesystem::remove(treePath);
+
+        if (stats.Partitions == 0 || !IsFlatKDTree(sorted)) {
+            return false;
+        }
+
+        std::sort(sorted.begin(), sorted.end(), TOrderByX());
+        std::sort(points.begin(), points.end(), TOrderByX());
+        if (sorted != points) {
+            return false;
+        }
+
+        for (int i = 0; i < 100; ++i) {
+            auto lower = TPoint{
+                .X = std::uniform_int_distribution<int>(0, maxValue)(random),
+                .Y = std::uniform_int_distribution<int>(0, maxValue)(random),
+            };
+            auto upper = TPoint{lower.X + maxValue / 10, lower.Y + maxValue / 10};
+
+            std::vector<TPoint> results;
+            TraverseFlatKDTree(tree, results, lower, upper);
+            auto expected = BruteForce(points, lower, upper);
+            std::sort(results.begin(), results.end(), TOrderByX());
+            std::sort(expected.begin(), expected.end(), TOrderByX());
+            if (results != expected) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 void StressTest()
 {
     static const int PointsCount = 1000;
@@ -362,12 +1367,440 @@ void StressTest()
     testCase.Output.insert(output.begin(), output.end());
 
     CheckTestCase(testCase);
+
+    // Narrow vertical strip.
+    auto stripX = RandomInRange(0, 100);
+    testCase.Lower = {stripX, 0};
+    testCase.Upper = {stripX + 1, 100};
+
+    output = BruteForce(testCase.Input, testCase.Lower, testCase.Upper);
+    testCase.Output.clear();
+    testCase.Output.insert(output.begin(), output.end());
+
+    CheckTestCase(testCase);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-int main()
+int RandomInRange(std::mt19937_64& random, int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(random);
+}
+
+TPoint RandomPoint(std::mt19937_64& random, int min, int max)
+{
+    return {.X = RandomInRange(random, min, max), .Y = RandomInRange(random, min, max)};
+}
+
+// Points are unique, kd-tree construction does not support duplicates.
+std::vector<TPoint> RandomUniquePoints(std::mt19937_64& random, int count, int min, int max)
+{
+    std::vector<TPoint> result;
+    std::unordered_set<TPoint, TPointHash> index;
+
+    for (int i = 0; i < count; ++i) {
+        auto point = RandomPoint(random, min, max);
+        if (index.insert(point).second) {
+            result.push_back(point);
+        }
+    }
+
+    return result;
+}
+
+TTestCase GenerateFuzzCase(std::mt19937_64& random)
+{
+    auto maxValue = RandomInRange(random, 1, 100);
+    auto first = RandomPoint(random, -10, maxValue + 10);
+    auto second = RandomPoint(random, -10, maxValue + 10);
+
+    return {
+        .Input = RandomUniquePoints(random, RandomInRange(random, 1, 200), 0, maxValue),
+        .Lower = {std::min(first.X, second.X), std::min(first.Y, second.Y)},
+        .Upper = {std::max(first.X, second.X), std::max(first.Y, second.Y)},
+    };
+}
+
+bool IsCorrect(const TTestCase& testCase)
 {
+    auto expected = BruteForce(testCase.Input, testCase.Lower, testCase.Upper);
+    std::sort(expected.begin(), expected.end(), TOrderByX());
+
+    for (const auto& engine : RangeSearchEngines) {
+        auto results = engine.Search(testCase.Input, testCase.Lower, testCase.Upper);
+        std::sort(results.begin(), results.end(), TOrderByX());
+        if (results != expected) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void PrintFuzzCase(const TTestCase& testCase)
+{
+    std::cout << "Input: " << testCase.Input
+        << " lower: " << testCase.Lower
+        << " upper: " << testCase.Upper
+        << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t MemoryUsage(const PNode& root)
+{
+    if (!root) {
+        return 0;
+    }
+
+    return sizeof(TNode) + MemoryUsage(root->Left) + MemoryUsage(root->Right);
+}
+
+size_t MemoryUsage(const PGrid& grid)
+{
+    if (!grid) {
+        return 0;
+    }
+
+    return sizeof(TGrid<TPoint>)
+        + grid->CellStart.capacity() * sizeof(int)
+        + grid->Points.capacity() * sizeof(TPoint);
+}
+
+size_t MemoryUsage(const PRangeNode& root)
+{
+    if (!root) {
+        return 0;
+    }
+
+    return sizeof(TRangeNode)
+        + root->ByY.capacity() * sizeof(TPoint)
+        + (root->LeftBridge.capacity() + root->RightBridge.capacity()) * sizeof(int)
+        + MemoryUsage(root->Left)
+        + MemoryUsage(root->Right);
+}
+
+size_t MemoryUsage(const std::vector<TPoint>& flatTree)
+{
+    return flatTree.capacity() * sizeof(TPoint);
+}
+
+template <typename TTree, typename TTraverse>
+void BenchmarkQueries(
+    const std::string& name,
+    const TTree& tree,
+    TTraverse traverse,
+    const std::vector<std::pair<TPoint, TPoint>>& queries)
+{
+    size_t reported = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (const auto& [lower, upper] : queries) {
+        std::vector<TPoint> results;
+        traverse(tree, results, lower, upper);
+        reported += results.size();
+    }
+
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+    std::cout << "    " << name
+        << ": " << elapsed.count() / queries.size() << " us/query"
+        << ", reported: " << reported
+        << ", memory: " << MemoryUsage(tree) / 1024 << " KiB"
+        << std::endl;
+}
+
+void BenchmarkLoaders(const std::vector<TPoint>& input)
+{
+    auto directory = std::filesystem::temp_directory_path();
+    auto binaryPath = (directory / "points_bench.bin").string();
+    auto textPath = (directory / "points_bench.txt").string();
+
+    WritePoints(binaryPath, input);
+    {
+        std::ofstream text(textPath);
+        for (const auto& point : input) {
+            text << point.X << ' ' << point.Y << '\n';
+        }
+    }
+
+    auto measure = [] (auto&& load) {
+        auto start = std::chrono::steady_clock::now();
+        auto count = load();
+        return std::make_pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), count);
+    };
+
+    // Summing coordinates touches every page of the mapping.
+    auto [mapped, mappedCount] = measure([&] {
+        TMappedFile file(binaryPath);
+        int64_t sum = 0;
+        for (const auto& point : MapPoints(file)) {
+            sum += point.X;
+        }
+        return MapPoints(file).size() + (sum < 0);
+    });
+    auto [parsed, parsedCount] = measure([&] {
+        TMappedFile file(textPath);
+        return ParsePoints(file.GetText()).size();
+    });
+    auto [streamed, streamedCount] = measure([&] {
+        std::ifstream text(textPath);
+        std::vector<TPoint> points;
+        TPoint point;
+        while (text >> point.X >> point.Y) {
+            points.push_back(point);
+        }
+        return points.size();
+    });
+    auto [construct, constructCount] = measure([&] {
+        TMappedFile file(binaryPath);
+        return ConstructKDTree(MapPoints(file)) ? MapPoints(file).size() : 0;
+    });
+
+    auto textSize = std::filesystem::file_size(textPath) / 1048576.0;
+    std::cout << "loaders, points: " << input.size()
+        << ", binary mmap: " << mapped << " s"
+        << ", text from_chars: " << parsed << " s (" << textSize / parsed << " MiB/s)"
+        << ", text iostream: " << streamed << " s (" << textSize / streamed << " MiB/s)"
+        << ", kd-tree straight from mmap: " << construct << " s"
+        << ", counts match: " << (mappedCount == parsedCount && parsedCount == streamedCount && streamedCount == constructCount)
+        << std::endl;
+
+    std::filesystem::remove(binaryPath);
+    std::filesystem::remove(textPath);
+}
+
+void Benchmark()
+{
+    static const int PointsCount = 1000000;
+    static const int QueriesCount = 1000;
+    static const int MaxValue = 100000;
+
+    std::unordered_set<TPoint, TPointHash> index;
+    for (int i = 0; i < PointsCount; ++i) {
+        index.insert(RandomPoint(0, MaxValue));
+    }
+    std::vector<TPoint> input(index.begin(), index.end());
+
+    BenchmarkLoaders(input);
+
+    auto kdTree = ConstructKDTree(input);
+    auto flatKDTree = input;
+    BuildFlatKDTree(flatKDTree);
+    auto rangeTree = ConstructRangeTree(input);
+    auto grid = ConstructGrid(input);
+
+    auto kdTraverse = [] (const PNode& root, std::vector<TPoint>& results, TPoint lower, TPoint upper) {
+        TraverseKDTree(root, results, lower, upper);
+    };
+    auto flatTraverse = [] (const std::vector<TPoint>& tree, std::vector<TPoint>& results, TPoint lower, TPoint upper) {
+        TraverseFlatKDTree(tree, results, lower, upper);
+    };
+    auto rangeTraverse = [] (const PRangeNode& root, std::vector<TPoint>& results, TPoint lower, TPoint upper) {
+        TraverseRangeTree(root, results, lower, upper);
+    };
+    auto gridTraverse = [] (const PGrid& grid, std::vector<TPoint>& results, TPoint lower, TPoint upper) {
+        TraverseGrid(grid, results, lower, upper);
+    };
+
+    struct TWorkload
+    {
+        std::string Name;
+        int Width = 0;
+        int Height = 0;
+    };
+
+    std::vector<TWorkload> workloads = {
+        {"square 1%", MaxValue / 100, MaxValue / 100},
+        {"square 10%", MaxValue / 10, MaxValue / 10},
+        {"vertical strip", 10, MaxValue},
+        {"horizontal strip", MaxValue, 10},
+    };
+
+    std::cout << "points: " << input.size() << std::endl;
+
+    for (const auto& workload : workloads) {
+        std::vector<std::pair<TPoint, TPoint>> queries;
+        for (int i = 0; i < QueriesCount; ++i) {
+            TPoint lower = {
+                .X = RandomInRange(0, MaxValue - workload.Width + 1),
+                .Y = RandomInRange(0, MaxValue - workload.Height + 1),
+            };
+            queries.emplace_back(lower, TPoint{lower.X + workload.Width, lower.Y + workload.Height});
+        }
+
+        std::cout << workload.Name << std::endl;
+        BenchmarkQueries("kdtree", kdTree, kdTraverse, queries);
+        BenchmarkQueries("flat kdtree", flatKDTree, flatTraverse, queries);
+        BenchmarkQueries("rangetree", rangeTree, rangeTraverse, queries);
+        BenchmarkQueries("grid", grid, gridTraverse, queries);
+    }
+}
+
+void PrintExternalBuild(const TExternalBuildStats& stats, double seconds, size_t memoryBytes)
+{
+    std::cout << "points: " << stats.PointsCount
+        << ", memory budget: " << memoryBytes / 1048576.0 << " MiB"
+        << ", time: " << seconds << " s"
+        << ", throughput: " << stats.PointsCount / seconds << " points/s"
+        << " (" << stats.PointsCount * sizeof(TPoint) / 1048576.0 / seconds << " MiB/s)"
+        << ", read: " << stats.BytesRead / 1048576 << " MiB"
+        << ", written: " << stats.BytesWritten / 1048576 << " MiB"
+        << ", partitions: " << stats.Partitions
+        << ", memory builds: " << stats.MemoryBuilds
+        << ", selection passes: " << stats.SelectionPasses
+        << ", peak RSS: " << PeakMemoryKiB() / 1024 << " MiB"
+        << std::endl;
+}
+
+// Writes the flat kd-tree of a binary points file with the memory budget.
+int BuildTree(const std::string& pointsPath, const std::string& treePath, size_t memoryBytes)
+{
+    ResetPeakMemory();
+    auto start = std::chrono::steady_clock::now();
+    auto stats = BuildExternalKDTree(pointsPath, treePath, {.MemoryBytes = memoryBytes});
+    PrintExternalBuild(stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), memoryBytes);
+    return 0;
+}
+
+// Streams random points to a file in chunks, so the input is never in memory,
+// and compares external builds with the in-memory build of the same points.
+void BenchmarkExternalBuild(int64_t pointsCount)
+{
+    static const int64_t ChunkSize = 1 << 20;
+
+    auto directory = std::filesystem::temp_directory_path();
+    auto pointsPath = (directory / "external_build_bench.bin").string();
+    auto treePath = (directory / "external_build_bench.kdtree").string();
+    {
+        TFile file(pointsPath, O_WRONLY | O_CREAT | O_TRUNC);
+        TBinaryHeader header {.Count = static_cast<uint64_t>(pointsCount)};
+        std::memcpy(header.Magic, PointsMagic, sizeof(header.Magic));
+        file.Write(&header, sizeof(header), 0);
+
+        std::mt19937_64 random(1);
+        std::uniform_int_distribution<int> coordinate(0, 1 << 30);
+        std::vector<TPoint> chunk;
+        for (int64_t done = 0; done < pointsCount; done += chunk.size()) {
+            chunk.resize(std::min(ChunkSize, pointsCount - done));
+            for (auto& point : chunk) {
+                point = {coordinate(random), coordinate(random)};
+            }
+            file.Write(chunk.data(), chunk.size() * sizeof(TPoint), sizeof(header) + done * sizeof(TPoint));
+        }
+    }
+
+    for (size_t memoryMiB : {16, 64, 256}) {
+        std::cout << "external build, ";
+        BuildTree(pointsPath, treePath, memoryMiB << 20);
+    }
+
+    ResetPeakMemory();
+    auto start = std::chrono::steady_clock::now();
+    {
+        TMappedFile file(pointsPath);
+        std::vector<TPoint> points(MapPoints(file).begin(), MapPoints(file).end());
+        BuildFlatKDTree(points);
+    }
+    std::cout << "in-memory build, time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s"
+        << ", peak RSS: " << PeakMemoryKiB() / 1024 << " MiB"
+        << std::endl;
+
+    std::filesystem::remove(pointsPath);
+    std::filesystem::remove(treePath);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reports points of a binary or text file inside of the range. A flat kd-tree
+// file written by the build mode is queried straight from the mapping.
+int Search(const std::string& path, TPoint lower, TPoint upper)
+{
+    auto start = std::chrono::steady_clock::now();
+    TMappedFile file(path);
+    if (IsBinary(file, FlatKDTreeMagic)) {
+        std::vector<TPoint> results;
+        TraverseFlatKDTree(MapFlatKDTree(file), results, lower, upper);
+
+        std::cout << "points: " << MapFlatKDTree(file).size()
+            << ", in range: " << results.size()
+            << ", flat kd-tree search: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s"
+            << std::endl;
+        return 0;
+    }
+
+    std::vector<TPoint> buffer;
+    auto input = LoadPoints(file, buffer);
+    auto load = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto kdTree = ConstructKDTree(input);
+    auto construct = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<TPoint> results;
+    TraverseKDTree(kdTree, results, lower, upper);
+
+    std::cout << "points: " << input.size()
+        << ", in range: " << results.size()
+        << ", load: " << load << " s"
+        << ", kd-tree construction: " << construct << " s"
+        << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+#if TRACING_ENABLED
+    std::atexit(DumpTrace);
+#endif
+
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        Benchmark();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "fuzz") {
+        uint64_t seed = argc > 2 ? std::stoull(argv[2]) : 1;
+        int64_t casesCount = argc > 3 ? std::stoll(argv[3]) : 1000000;
+        int threadsCount = argc > 4 ? std::stoi(argv[4]) : 0;
+        return FuzzTest(seed, casesCount, threadsCount, GenerateFuzzCase, IsCorrect, PrintFuzzCase);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "buildbench") {
+        BenchmarkExternalBuild(argc > 2 ? std::stoll(argv[2]) : 50000000);
+        return 0;
+    }
+
+    if (argc > 3 && std::string(argv[1]) == "build") {
+        size_t memoryMiB = argc > 4 ? std::stoull(argv[4]) : 64;
+        return BuildTree(argv[2], argv[3], memoryMiB << 20);
+    }
+
+    if (argc > 6 && std::string(argv[1]) == "search") {
+        auto lower = TPoint{std::stoi(argv[3]), std::stoi(argv[4])};
+        auto upper = TPoint{std::stoi(argv[5]), std::stoi(argv[6])};
+        return Search(argv[2], lower, upper);
+    }
+
+    if (!LoaderTest()) {
+        std::cout << "Loaded points do not match!" << std::endl;
+        return 1;
+    }
+
+    if (!ExternalBuildTest()) {
+        std::cout << "External kd-tree build is broken!" << std::endl;
+        return 1;
+    }
+
+    if (!DegenerateGridTest()) {
+        std::cout << "Grid of a degenerate box is broken!" << std::endl;
+        return 1;
+    }
+
+    if (!TraceRingTest()) {
+        std::cout << "Trace ring lost or tore records!" << std::endl;
+        return 1;
+    }
+
     std::vector<TTestCase> tests {
         {
             .Input = {{-10, -10}, {0, 0}, {10, 10}, {20, 20}},
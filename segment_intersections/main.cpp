@@ -1,15 +1,33 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <compare>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 
 #include <iterator>
+#include <limits>
+#include <memory_resource>
+#include <numeric>
 #include <map>
 #include <math.h>
 #include <optional>
 #include <ostream>
+#include <queue>
+#include <random>
+#include <span>
 #include <sstream>
 
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -17,13 +35,75 @@
 #include <vector>
 #include <set>
 #include <cmath>
+#include <cstdlib>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-bool DebugIsDisabled = true;
+#include "../common/common.h"
 
-#define debugStream \
-    if (DebugIsDisabled) {} \
-    else std::cerr
+// Tracing is compiled in with -DTRACING_ENABLED=1. Otherwise TRACE expands to
+// nothing and its arguments are not evaluated, so there is no trace code left
+// in the hot loops.
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 0
+#endif
+
+enum class ETraceEvent : uint8_t
+{
+    // Intersection of neighbors is found: left segment, right segment.
+    FoundIntersection,
+    // Segment is inserted into the sweep line: segment.
+    AddSegment,
+    // Inserted segment is checked against a neighbor: segment, neighbor.
+    CheckNeighbor,
+    // Segment is removed to be reordered at the intersection point: segment.
+    HandleIntersection,
+    // Segment ends: segment.
+    RemoveSegment,
+    // Segment grid is built: cells by x, cells by y, cell side, and the
+    // estimated cell side before rounding in millionths.
+    GridCells,
+};
+
+std::string_view ToString(ETraceEvent event)
+{
+    switch (event) {
+        case ETraceEvent::FoundIntersection:
+            return "FoundIntersection";
+        case ETraceEvent::AddSegment:
+            return "AddSegment";
+        case ETraceEvent::CheckNeighbor:
+            return "CheckNeighbor";
+        case ETraceEvent::HandleIntersection:
+            return "HandleIntersection";
+        case ETraceEvent::RemoveSegment:
+            return "RemoveSegment";
+        case ETraceEvent::GridCells:
+            return "GridCells";
+    }
+    return "Unknown";
+}
+
+#if TRACING_ENABLED
+TTraceRing<ETraceEvent> TraceRing;
+
+// Writes the trace to the file named by TRACE_OUTPUT, trace.tsv by default.
+void DumpTrace()
+{
+    const char* path = std::getenv("TRACE_OUTPUT");
+    std::ofstream output(path ? path : "trace.tsv");
+    TraceRing.Dump(output);
+}
+
+#define TRACE(event, ...) TraceRing.Push(ETraceEvent::event, __VA_ARGS__)
+#else
+#define TRACE(event, ...) static_cast<void>(0)
+#endif
 
 static constexpr double Precision = 0.000001;
 
@@ -123,86 +203,142 @@ std::ostream& operator <<(std::ostream& stream, const std::unordered_set<const T
 
 ///////////////////////////////////////////////////////////////////////
 
-struct TLineParameters
+// Segment endpoints must have integer coordinates not exceeding MaxCoordinate
+// by absolute value. Then orientation of three endpoints is exact in int64 and
+// rational intersection points are compared exactly in __int128.
+static constexpr int64_t MaxCoordinate = 1 << 22;
+
+using TInt128 = __int128;
+
+struct TIntegerPoint
 {
-    std::optional<double> K;
-    double C = 0;
+    int64_t X = 0;
+    int64_t Y = 0;
+};
 
-    auto operator<=>(const TLineParameters&) const = default;
+bool IsSupported(const TPoint& point)
+{
+    return point.X == std::floor(point.X) && std::abs(point.X) <= MaxCoordinate
+        && point.Y == std::floor(point.Y) && std::abs(point.Y) <= MaxCoordinate;
+}
 
-    std::optional<double> GetAtX(double x) const
-    {
-        if (!K) {
-            return {};
+// Engines only Verify the coordinates, so the loaded input is checked once
+// with a readable error before it gets to them.
+void VerifySupported(std::span<const TSegment> segments)
+{
+    for (int64_t i = 0; i < std::ssize(segments); ++i) {
+        if (!IsSupported(segments[i].Begin) || !IsSupported(segments[i].End)) {
+            std::stringstream message;
+            message << "Segment " << i << " " << segments[i]
+                << " is not supported, coordinates must be integers not exceeding "
+                << MaxCoordinate << " by absolute value";
+            throw std::runtime_error(message.str());
         }
+    }
+}
+
+TIntegerPoint ToIntegerPoint(const TPoint& point)
+{
+    Verify(IsSupported(point));
+
+    return {.X = static_cast<int64_t>(point.X), .Y = static_cast<int64_t>(point.Y)};
+}
+
+int Sign(TInt128 value)
+{
+    return (value > 0) - (value < 0);
+}
+
+// Positive if c is to the left of the line a -> b, negative if to the right.
+int Orientation(TIntegerPoint a, TIntegerPoint b, TIntegerPoint c)
+{
+    return Sign((b.X - a.X) * (c.Y - a.Y) - (b.Y - a.Y) * (c.X - a.X));
+}
+
+// Point (X / Denominator, Y / Denominator), Denominator is positive. Every
+// intersection of two segments is represented exactly.
+struct TExactPoint
+{
+    TInt128 X = 0;
+    TInt128 Y = 0;
+    TInt128 Denominator = 1;
 
-        return RoundToPrecision(*K * x + C);
+    static TExactPoint FromPoint(const TPoint& point)
+    {
+        auto integer = ToIntegerPoint(point);
+        return {.X = integer.X, .Y = integer.Y};
     }
-};
 
-TLineParameters GetLineParameters(const TSegment& segment) {
-    const auto& [p1, p2] = segment;
-    double k = 0;
-    if (p2.X == p1.X) {
-        return TLineParameters {
-            .C = p1.X,
-        };
+    std::strong_ordering operator<=>(const TExactPoint& other) const
+    {
+        if (auto x = X * other.Denominator <=> other.X * Denominator; x != 0) {
+            return x;
+        }
+        return Y * other.Denominator <=> other.Y * Denominator;
     }
 
-    k = static_cast<double>(p2.Y - p1.Y) / (p2.X - p1.X);
+    bool operator==(const TExactPoint& other) const
+    {
+        return (*this <=> other) == 0;
+    }
 
-    double c = p1.Y - p1.X * k;
+    TPoint ToPoint() const
+    {
+        return {
+            .X = static_cast<double>(X) / static_cast<double>(Denominator),
+            .Y = static_cast<double>(Y) / static_cast<double>(Denominator),
+        };
+    }
+};
 
-    return TLineParameters {
-        .K = k,
-        .C = c,
-    };
+std::ostream& operator <<(std::ostream& stream, const TExactPoint& point) {
+    stream << point.ToPoint();
+    return stream;
 }
 
-std::optional<TPoint> GetIntersection(const TSegment& s1, const TSegment& s2) {
-    auto line1 = GetLineParameters(s1);
-    auto line2 = GetLineParameters(s2);
+// Collinear segments are not reported even if they overlap.
+std::optional<TExactPoint> GetExactIntersection(const TSegment& first, const TSegment& second) {
+    auto a1 = ToIntegerPoint(first.Begin);
+    auto a2 = ToIntegerPoint(first.End);
+    auto b1 = ToIntegerPoint(second.Begin);
+    auto b2 = ToIntegerPoint(second.End);
 
-    if (line1.K == line2.K) { 
+    auto o1 = Orientation(a1, a2, b1);
+    auto o2 = Orientation(a1, a2, b2);
+    auto o3 = Orientation(b1, b2, a1);
+    auto o4 = Orientation(b1, b2, a2);
+
+    if (o1 == 0 && o2 == 0) {
         return {};
     }
 
-    double x = 0;
-    double y = 0;
-
-    if (!line2.K) {
-        std::swap(line1, line2);
+    if (o1 * o2 > 0 || o3 * o4 > 0) {
+        return {};
     }
 
-    if (!line1.K) {
-        x = line1.C;
-        y = *line2.K * x + line2.C;
-    } else {
-        x = (line2.C - line1.C) / (*line1.K - *line2.K);
-        y = *line1.K * x + line1.C;
-        auto y2 = *line2.K * x + line2.C;
-        if (std::abs(y - y2) > 2 * Precision) {
-            debugStream << "intersections does not match :" << x << " y1:" << y << " y2:" << y2 << std::endl;
-            return {};
-        }
+    // first.Begin + (first.End - first.Begin) * t / denominator
+    TInt128 denominator = (a2.X - a1.X) * (b2.Y - b1.Y) - (a2.Y - a1.Y) * (b2.X - b1.X);
+    TInt128 t = (b1.X - a1.X) * (b2.Y - b1.Y) - (b1.Y - a1.Y) * (b2.X - b1.X);
+
+    if (denominator < 0) {
+        denominator = -denominator;
+        t = -t;
     }
 
-    auto result = TPoint{
-        .X = RoundToPrecision(x),
-        .Y = RoundToPrecision(y),
+    return TExactPoint{
+        .X = a1.X * denominator + (a2.X - a1.X) * t,
+        .Y = a1.Y * denominator + (a2.Y - a1.Y) * t,
+        .Denominator = denominator,
     };
+}
 
-    if (s1.Contains(result) && s2.Contains(result)) {
-        return result;
+std::optional<TPoint> GetIntersection(const TSegment& first, const TSegment& second) {
+    auto intersection = GetExactIntersection(first, second);
+    if (!intersection) {
+        return {};
     }
 
-    debugStream << "intersection is not contained point:"
-        << result
-        <<" s1" << s1 << " contains:" << s1.Contains(result)
-        <<" s2" << s2 << " contains:" << s2.Contains(result)
-        << std::endl;
-
-    return {};
+    return intersection->ToPoint();
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -268,245 +404,2888 @@ TIntersections BruteForce(const std::vector<TSegment>& input) {
     return result;
 }
 
+TIntersections RedBlueBruteForce(const std::vector<TSegment>& red, const std::vector<TSegment>& blue) {
+    TIntersections result;
+    for (const auto& redSegment : red) {
+        for (const auto& blueSegment : blue) {
+            auto point = GetIntersection(redSegment, blueSegment);
+            if (!point) {
+                continue;
+            }
+            result[*point].insert(redSegment);
+            result[*point].insert(blueSegment);
+        }
+    }
+
+    return result;
+}
+
 ///////////////////////////////////////////////////////////////////////
 
+// All segments touching the current event point. Buffers are reused between
+// events, so processing an event does not allocate.
 struct TEvent
 {
-    std::unordered_set<const TSegment*> Starting;
-    std::unordered_set<const TSegment*> Intersecting;
-    std::unordered_set<const TSegment*> Ending;
+    TExactPoint Point;
+    std::pmr::vector<const TSegment*> Starting;
+    std::pmr::vector<const TSegment*> Intersecting;
+    std::pmr::vector<const TSegment*> Ending;
+
+    explicit TEvent(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : Starting(resource)
+        , Intersecting(resource)
+        , Ending(resource)
+    { }
+
+    void Clear()
+    {
+        Starting.clear();
+        Intersecting.clear();
+        Ending.clear();
+    }
+
+    void AddIntersecting(const TSegment* segment)
+    {
+        if (std::find(Intersecting.begin(), Intersecting.end(), segment) == Intersecting.end()) {
+            Intersecting.push_back(segment);
+        }
+    }
 };
 
-struct TTrackingSegment
+// Endpoints are ordered by integer keys instead of exact points: coordinates
+// are shifted to be non-negative and packed as x:y, so keys are ordered as points.
+struct TEndpoint
 {
-    const TSegment* Segment = nullptr;
-    TLineParameters Parameters;
-    double StartX = 0;
-
-    TTrackingSegment(const TSegment* segment, double startX)
-        : Segment(segment)
-        , Parameters(GetLineParameters(*segment))
-        , StartX(startX)
-    { }
+    static constexpr int CoordinateBits = 24;
+    static constexpr int KeyBits = 2 * CoordinateBits;
 
-    bool operator<(const TTrackingSegment& other) const {
-        auto startX = std::max(StartX, other.StartX);
-        auto endX = std::max(Segment->End.X, other.Segment->End.X);
-        
-        auto leftStart = Parameters.GetAtX(startX);
-        auto leftEnd = Parameters.GetAtX(endX);
+    uint64_t Key = 0;
+    // Index in the input.
+    uint32_t Segment = 0;
+    bool IsEnd = false;
 
-        auto rightStart = other.Parameters.GetAtX(startX);
-        auto rightEnd = other.Parameters.GetAtX(endX);
+    static uint64_t MakeKey(const TIntegerPoint& point)
+    {
+        return static_cast<uint64_t>(point.X + MaxCoordinate) << CoordinateBits
+            | static_cast<uint64_t>(point.Y + MaxCoordinate);
+    }
 
-        return std::make_pair(*leftStart, *leftEnd) < std::make_pair(*rightStart, *rightEnd);
+    TExactPoint GetPoint() const
+    {
+        return {
+            .X = static_cast<int64_t>(Key >> CoordinateBits) - MaxCoordinate,
+            .Y = static_cast<int64_t>(Key & ((uint64_t(1) << CoordinateBits) - 1)) - MaxCoordinate,
+        };
     }
 };
 
-void Verify(bool predicate)
+static_assert(2 * MaxCoordinate < (int64_t(1) << TEndpoint::CoordinateBits));
+
+struct TIntersectionEvent
 {
-    if (!predicate) {
-        throw std::runtime_error("Critical condition is failed");
+    TExactPoint Point;
+    const TSegment* Left = nullptr;
+    const TSegment* Right = nullptr;
+
+    bool operator>(const TIntersectionEvent& other) const
+    {
+        return Point > other.Point;
     }
-}
+};
 
-struct TSweepingLine
+// Endpoints are known in advance and are kept in a sorted array, intersections
+// are found during the sweep and go to a binary heap. The same intersection may
+// be scheduled several times, duplicates are merged when the event is popped.
+struct TEventQueue
 {
-    using TSegmentsTree = std::multiset<TTrackingSegment>;
+    const TSegment* Input = nullptr;
+    std::pmr::vector<TEndpoint> Endpoints;
+    // Scratch space of the radix sort.
+    std::pmr::vector<TEndpoint> SortBuffer;
+    size_t Position = 0;
+    std::priority_queue<TIntersectionEvent, std::pmr::vector<TIntersectionEvent>, std::greater<>> Intersections;
 
-    TSegmentsTree Segments;
-    std::unordered_map<const TSegment*, TSegmentsTree::iterator> Index;
+    explicit TEventQueue(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : Endpoints(resource)
+        , SortBuffer(resource)
+        , Intersections(std::pmr::polymorphic_allocator<TIntersectionEvent>(resource))
+    { }
 
-    void Add(const TSegment* segment, double startX)
+    bool Empty() const
     {
-        Verify(Index.count(segment) == 0);
-        auto it = Segments.insert(TTrackingSegment(segment, startX));
-        Index.insert(std::make_pair(segment, it));
+        return Position == Endpoints.size() && Intersections.empty();
     }
 
-    void Remove(const TSegment* segment)
+    void AddIntersection(const TExactPoint& point, const TSegment* left, const TSegment* right)
     {
-        auto it = Index.find(segment);
-        Verify(it != Index.end());
-
-        Segments.erase(it->second);
-        Index.erase(it);
+        Intersections.push({.Point = point, .Left = left, .Right = right});
     }
 
-    std::array<const TSegment*, 2> GetNeighbors(const TSegment* segment)
+    // Drops endpoints to the left of the vertical line.
+    void SkipBefore(int64_t x)
     {
-        auto indexIt = Index.find(segment);
-        Verify(indexIt != Index.end());
-
-        auto it = indexIt->second;
+        auto key = TEndpoint::MakeKey({.X = x, .Y = -MaxCoordinate});
+        Position = std::partition_point(Endpoints.begin() + Position, Endpoints.end(), [key] (const TEndpoint& endpoint) {
+            return endpoint.Key < key;
+        }) - Endpoints.begin();
+    }
 
-        std::array<const TSegment*, 2> result = {};
+    void Pop(TEvent& event)
+    {
+        event.Clear();
 
-        if (it != Segments.begin()) {
-            auto before = std::prev(it);
-            result[0] = before->Segment;
+        event.Point = Position < Endpoints.size() ? Endpoints[Position].GetPoint() : Intersections.top().Point;
+        if (!Intersections.empty() && Intersections.top().Point < event.Point) {
+            event.Point = Intersections.top().Point;
         }
 
-        auto after = std::next(it);
-        if (after != Segments.end()) {
-            result[1] = after->Segment;
+        // Coincident endpoints have equal keys and are neighbors in the sorted array.
+        if (Position < Endpoints.size() && Endpoints[Position].GetPoint() == event.Point) {
+            auto key = Endpoints[Position].Key;
+            for (; Position < Endpoints.size() && Endpoints[Position].Key == key; ++Position) {
+                auto& segments = Endpoints[Position].IsEnd ? event.Ending : event.Starting;
+                segments.push_back(Input + Endpoints[Position].Segment);
+            }
         }
 
-        return result;
+        for (; !Intersections.empty() && Intersections.top().Point == event.Point; Intersections.pop()) {
+            event.AddIntersecting(Intersections.top().Left);
+            event.AddIntersecting(Intersections.top().Right);
+        }
     }
 };
 
-std::map<TPoint, TEvent> MakeEventQueue(const std::vector<TSegment>& input)
+struct TSweepStats
 {
-    std::map<TPoint, TEvent> result;
-    for (const auto& segment : input) {
-        result[segment.Begin].Starting.insert(&segment);
-        result[segment.End].Ending.insert(&segment);
-    }
-    return result;
-}
+    int64_t Events = 0;
+    int64_t IntersectionEvents = 0;
+    // Making and sorting endpoint events.
+    double SetupSeconds = 0;
+    double SweepSeconds = 0;
+};
 
-TIntersections SweepLine(const std::vector<TSegment>& input)
+// Point where the sweep line currently is and its floating point approximation
+// used to filter exact computations.
+struct TSweepPosition
 {
-    auto queue = MakeEventQueue(input);
-    TSweepingLine sweepLine;
-    TIntersections result;
+    TExactPoint Point;
+    TPoint Approximation;
+};
 
-    auto handleIntersections = [&] (const TPoint& eventPoint, const TSegment* left, const TSegment* right) {
-        if (left == nullptr || right == nullptr) {
-            return;
+struct TTrackingSegment
+{
+    const TSegment* Segment = nullptr;
+    TIntegerPoint Begin;
+    TIntegerPoint End;
+
+    explicit TTrackingSegment(const TSegment* segment)
+        : Segment(segment)
+        , Begin(ToIntegerPoint(segment->Begin))
+        , End(ToIntegerPoint(segment->End))
+    { }
+
+    bool IsVertical() const
+    {
+        return Begin.X == End.X;
+    }
+
+    // Positive if the sweep point is above the segment, zero if the segment
+    // passes through it.
+    int GetSide(const TSweepPosition& position) const
+    {
+        const auto& point = position.Point;
+
+        // Vertical segment is on the sweep line only at its own x.
+        if (IsVertical()) {
+            if (point.Y > End.Y * point.Denominator) {
+                return 1;
+            }
+            if (point.Y < Begin.Y * point.Denominator) {
+                return -1;
+            }
+            return 0;
         }
-        auto intersection = GetIntersection(*left, *right);
-        if (!intersection || *intersection < eventPoint) {
-            return;
+
+        // Floating point filter, the bound covers rounding of the approximation
+        // and of the expression itself.
+        double dx = End.X - Begin.X;
+        double dy = End.Y - Begin.Y;
+        const auto& approximation = position.Approximation;
+
+        double determinant = dx * (approximation.Y - Begin.Y) - dy * (approximation.X - Begin.X);
+        double bound = 8 * std::numeric_limits<double>::epsilon()
+            * (std::abs(dx) * (std::abs(approximation.Y) + std::abs(Begin.Y))
+                + std::abs(dy) * (std::abs(approximation.X) + std::abs(Begin.X)));
+
+        if (determinant > bound) {
+            return 1;
+        }
+        if (determinant < -bound) {
+            return -1;
+        }
+
+        // Exact check: dx * (Y / D - y) - dy * (X / D - x) multiplied by D > 0.
+        return Sign(
+            (End.X - Begin.X) * (point.Y - Begin.Y * point.Denominator)
+            - (End.Y - Begin.Y) * (point.X - Begin.X * point.Denominator));
+    }
+
+    // Order of two segments right after their common point. Vertical segments
+    // are the steepest ones.
+    std::strong_ordering CompareSlope(const TTrackingSegment& other) const
+    {
+        if (IsVertical() || other.IsVertical()) {
+            return IsVertical() <=> other.IsVertical();
         }
 
-        debugStream << "found intersection point:" << *intersection << std::endl;
+        return (End.Y - Begin.Y) * (other.End.X - other.Begin.X)
+            <=> (other.End.Y - other.Begin.Y) * (End.X - Begin.X);
+    }
+};
 
-        auto& item = queue[*intersection];
+// Segments crossing the sweep line ordered from bottom to top. Balanced by
+// random priorities (treap). Nodes are linked by indices and taken from a pool
+// where removed nodes are reused, so the nodes of the sweep line stay compact
+// in memory. Node of a segment is found by the segment index in the input, so
+// operations need neither hashing nor allocations.
+struct TSweepingLine
+{
+    static constexpr int None = -1;
 
-        item.Intersecting.insert(left);
-        item.Intersecting.insert(right);
+    struct TNode
+    {
+        TTrackingSegment Segment;
+        int Left = None;
+        int Right = None;
+        int Parent = None;
+        uint32_t Priority = 0;
     };
 
-    auto addSegment = [&] (const TSegment* segment, const TPoint& eventPoint) {
-        debugStream << "adding segment:" << segment  << " value:" << *segment << std::endl;
-        sweepLine.Add(segment, eventPoint.X);
+    const TSegment* Input = nullptr;
+    // Node of every input segment or None if the segment is not on the sweep line.
+    std::pmr::vector<int> SegmentNodes;
+    std::pmr::vector<TNode> Nodes;
+    std::pmr::vector<int> FreeNodes;
+    int Root = None;
+    TSweepPosition Position;
 
-        for (const auto* neighbor : sweepLine.GetNeighbors(segment)) {
-            debugStream << "check neighbor:" << neighbor << std::endl;
-            handleIntersections(eventPoint, segment, neighbor);
+    TSweepingLine() = default;
+
+    explicit TSweepingLine(std::span<const TSegment> input, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : Input(input.data())
+        , SegmentNodes(input.size(), None, resource)
+        , Nodes(resource)
+        , FreeNodes(resource)
+    { }
+
+    // Starts sweeping another input, allocated memory is kept.
+    void Reset(std::span<const TSegment> input)
+    {
+        Input = input.data();
+        SegmentNodes.assign(input.size(), None);
+        Nodes.clear();
+        FreeNodes.clear();
+        Root = None;
+    }
+
+    TSweepingLine(const TSweepingLine&) = delete;
+    TSweepingLine& operator=(const TSweepingLine&) = delete;
+
+    static uint32_t GetPriority(uint64_t index)
+    {
+        // splitmix64 finalizer.
+        index += 0x9e3779b97f4a7c15;
+        index = (index ^ (index >> 30)) * 0xbf58476d1ce4e5b9;
+        index = (index ^ (index >> 27)) * 0x94d049bb133111eb;
+        return static_cast<uint32_t>(index ^ (index >> 31));
+    }
+
+    int& GetNode(const TSegment* segment)
+    {
+        auto index = segment - Input;
+        Verify(index >= 0 && index < std::ssize(SegmentNodes));
+        return SegmentNodes[index];
+    }
+
+    int AllocateNode(const TSegment* segment)
+    {
+        TNode node {
+            .Segment = TTrackingSegment(segment),
+            .Priority = GetPriority(segment - Input),
+        };
+
+        if (FreeNodes.empty()) {
+            Nodes.push_back(node);
+            return std::ssize(Nodes) - 1;
         }
-    };
 
-    while(!queue.empty()) {
-        auto current = queue.begin();
-        const auto& [eventPoint, event] = *current;
+        auto result = FreeNodes.back();
+        FreeNodes.pop_back();
+        Nodes[result] = node;
+        return result;
+    }
 
-        for (const auto* segment : event.Starting) {
-            addSegment(segment, eventPoint);
+    void MoveTo(const TExactPoint& point)
+    {
+        if (point != Position.Point) {
+            Position.Point = point;
+            Position.Approximation = point.ToPoint();
         }
+    }
 
-        for (const auto* segment : event.Intersecting) {
-            debugStream << "handling intersection:" << eventPoint << " segment:" << *segment << std::endl;
-            result[eventPoint].insert(*segment);
-            sweepLine.Remove(segment);
+    // Inserted segment must pass through the event point.
+    bool IsLower(const TTrackingSegment& inserted, const TTrackingSegment& existing) const
+    {
+        if (auto side = existing.GetSide(Position); side != 0) {
+            return side < 0;
         }
+        return inserted.CompareSlope(existing) < 0;
+    }
+
+    void Add(const TSegment* segment, const TExactPoint& eventPoint)
+    {
+        auto& segmentNode = GetNode(segment);
+        Verify(segmentNode == None);
 
-        for (const auto* segment : event.Intersecting) {
-            auto moved = eventPoint;
-            moved.X += Precision;
-            addSegment(segment, moved);
+        MoveTo(eventPoint);
+
+        auto node = segmentNode = AllocateNode(segment);
+
+        if (Root == None) {
+            Root = node;
+            return;
         }
 
-        for (const auto* segment : event.Ending) {
-            debugStream << "removing segment:" << eventPoint << " segment:" << *segment << std::endl;
-            auto [before, after] = sweepLine.GetNeighbors(segment);
-            sweepLine.Remove(segment);
-            handleIntersections(eventPoint, before, after);
+        // Equal segments go after existing ones, as in std::multiset.
+        auto current = Root;
+        while (true) {
+            auto& child = IsLower(Nodes[node].Segment, Nodes[current].Segment)
+                ? Nodes[current].Left
+                : Nodes[current].Right;
+
+            if (child == None) {
+                child = node;
+                Nodes[node].Parent = current;
+                break;
+            }
+            current = child;
         }
 
-        Verify(queue.begin() == current);
-        queue.erase(current);
+        while (Nodes[node].Parent != None && Nodes[Nodes[node].Parent].Priority < Nodes[node].Priority) {
+            RotateUp(node);
+        }
     }
 
-    return result;
-}
+    // Puts the segment above all segments of the sweep line, so already ordered
+    // segments are added without comparisons.
+    void AddLast(const TSegment* segment)
+    {
+        auto& segmentNode = GetNode(segment);
+        Verify(segmentNode == None);
 
-///////////////////////////////////////////////////////////////////////
+        auto node = segmentNode = AllocateNode(segment);
 
-void Normalize(TTest& testCase)
-{
-    for (auto& segment : testCase.Input) {
-        segment.Normalize();
-    }
+        if (Root == None) {
+            Root = node;
+            return;
+        }
 
-    for (auto& [point, segments] : testCase.Expected) {
-        std::set<TSegment> normalized;
-        for (auto segment : segments) {
-            segment.Normalize();
-            normalized.insert(segment);
+        auto last = Root;
+        while (Nodes[last].Right != None) {
+            last = Nodes[last].Right;
         }
-        normalized.swap(segments);
-    }
-}
+        Nodes[last].Right = node;
+        Nodes[node].Parent = last;
 
-void Normalize(std::vector<TTest>& testCases)
-{
-    for (auto& testCase : testCases) {
-        Normalize(testCase);
+        while (Nodes[node].Parent != None && Nodes[Nodes[node].Parent].Priority < Nodes[node].Priority) {
+            RotateUp(node);
+        }
     }
-}
 
-double RandomInRange(int min, int max)
-{
-    int total = std::abs(min) + max;
-    return rand() % total - std::abs(min);
-}
+    void Remove(const TSegment* segment)
+    {
+        auto& segmentNode = GetNode(segment);
+        Verify(segmentNode != None);
 
-TPoint RandomPoint(int min, int max)
-{
-    return {.X = RandomInRange(min, max), .Y = RandomInRange(min, max)};
-}
+        auto node = segmentNode;
 
-int StressTest()
-{
-    static const int SegmentsCount = 3;
-    static const int TestsCount = 1000000;
+        // Rotate the node down to a leaf keeping the heap order of priorities.
+        while (Nodes[node].Left != None || Nodes[node].Right != None) {
+            auto left = Nodes[node].Left;
+            auto right = Nodes[node].Right;
 
-    int minValue = -10;
-    int maxValue = 10;
+            if (right == None || (left != None && Nodes[left].Priority > Nodes[right].Priority)) {
+                RotateUp(left);
+            } else {
+                RotateUp(right);
+            }
+        }
 
-    for (int i = 0; i < TestsCount; ++i) {
-        std::unordered_set<double> uniqueness;
-        TTest testCase;
+        ReplaceChild(Nodes[node].Parent, node, None);
+        FreeNodes.push_back(node);
+        segmentNode = None;
+    }
 
-        for (int segmentIndex = 0; segmentIndex < SegmentsCount; ++segmentIndex) {
-            TSegment segment {
-                .Begin = RandomPoint(minValue, maxValue),
-                .End = RandomPoint(minValue, maxValue),
-            };
+    std::array<const TSegment*, 2> GetNeighbors(const TSegment* segment)
+    {
+        auto node = GetNode(segment);
+        Verify(node != None);
 
-            segment.Normalize();
-            auto parameters = GetLineParameters(segment);
-            if (!parameters.K) {
-                continue;
-            }
+        std::array<const TSegment*, 2> result = {};
 
-            if (!uniqueness.insert(*parameters.K).second) {
-                continue;
-            }
+        if (auto before = GetPrevious(node); before != None) {
+            result[0] = Nodes[before].Segment.Segment;
+        }
 
-            testCase.Input.push_back(std::move(segment));
-            testCase.Expected = BruteForce(testCase.Input);
-            if (!CheckTestCase(testCase, SweepLine(testCase.Input))) {
-                std::cout << "Input: " << testCase.Input << std::endl;
+        if (auto after = GetNext(node); after != None) {
+            result[1] = Nodes[after].Segment.Segment;
+        }
 
-                for (const auto& [point, segments] : testCase.Expected) {
-                    std::cout << "Intersection : " << point  << " segments: " << segments << std::endl;
-                }
-                return 1;
-            }
+        return result;
+    }
+
+    void ReplaceChild(int parent, int from, int to)
+    {
+        if (parent == None) {
+            Root = to;
+        } else if (Nodes[parent].Left == from) {
+            Nodes[parent].Left = to;
+        } else {
+            Nodes[parent].Right = to;
+        }
+    }
+
+    // Rotates the node above its parent, in-order sequence is not changed.
+    void RotateUp(int node)
+    {
+        auto parent = Nodes[node].Parent;
+        auto grandParent = Nodes[parent].Parent;
+
+        int moved = None;
+        if (Nodes[parent].Left == node) {
+            moved = Nodes[node].Right;
+            Nodes[parent].Left = moved;
+            Nodes[node].Right = parent;
+        } else {
+            moved = Nodes[node].Left;
+            Nodes[parent].Right = moved;
+            Nodes[node].Left = parent;
+        }
+
+        if (moved != None) {
+            Nodes[moved].Parent = parent;
+        }
+
+        Nodes[parent].Parent = node;
+        Nodes[node].Parent = grandParent;
+        ReplaceChild(grandParent, parent, node);
+    }
+
+    int GetPrevious(int node) const
+    {
+        if (Nodes[node].Left != None) {
+            node = Nodes[node].Left;
+            while (Nodes[node].Right != None) {
+                node = Nodes[node].Right;
+            }
+            return node;
+        }
+
+        while (Nodes[node].Parent != None && Nodes[Nodes[node].Parent].Left == node) {
+            node = Nodes[node].Parent;
+        }
+        return Nodes[node].Parent;
+    }
+
+    int GetNext(int node) const
+    {
+        if (Nodes[node].Right != None) {
+            node = Nodes[node].Right;
+            while (Nodes[node].Left != None) {
+                node = Nodes[node].Left;
+            }
+            return node;
+        }
+
+        while (Nodes[node].Parent != None && Nodes[Nodes[node].Parent].Right == node) {
+            node = Nodes[node].Parent;
+        }
+        return Nodes[node].Parent;
+    }
+};
+
+// Calls function(thread) for every thread index, the first one runs in the
+// calling thread. The first exception thrown by any thread is rethrown.
+template <class TFunction>
+void RunInThreads(int threadsCount, TFunction&& function)
+{
+    if (threadsCount <= 1) {
+        function(0);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(threadsCount);
+    auto run = [&] (int thread) {
+        try {
+            function(thread);
+        } catch (...) {
+            errors[thread] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < threadsCount; ++thread) {
+        threads.emplace_back(run, thread);
+    }
+    run(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// LSD radix sort of endpoints by keys. Every pass splits the array into
+// contiguous chunks, one per thread: threads count digits in their chunks, then
+// move items to the offsets given by prefix sums over buckets and then chunks,
+// which keeps the sort stable. Passes where all keys have the same digit are
+// skipped.
+void RadixSortEndpoints(std::pmr::vector<TEndpoint>& endpoints, std::pmr::vector<TEndpoint>& buffer, int threadsCount)
+{
+    static constexpr int DigitBits = 12;
+    static constexpr size_t Buckets = 1 << DigitBits;
+
+    buffer.resize(endpoints.size());
+    std::pmr::vector<size_t> offsets(threadsCount * Buckets, endpoints.get_allocator());
+
+    auto getChunk = [&] (int thread) {
+        return std::pair(endpoints.size() * thread / threadsCount, endpoints.size() * (thread + 1) / threadsCount);
+    };
+
+    for (int shift = 0; shift < TEndpoint::KeyBits; shift += DigitBits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        RunInThreads(threadsCount, [&] (int thread) {
+            auto* counts = offsets.data() + thread * Buckets;
+            auto [begin, end] = getChunk(thread);
+            for (auto i = begin; i < end; ++i) {
+                ++counts[(endpoints[i].Key >> shift) & (Buckets - 1)];
+            }
+        });
+
+        bool isSameDigit = false;
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < Buckets; ++bucket) {
+            auto bucketBegin = offset;
+            for (int thread = 0; thread < threadsCount; ++thread) {
+                auto count = offsets[thread * Buckets + bucket];
+                offsets[thread * Buckets + bucket] = offset;
+                offset += count;
+            }
+            isSameDigit |= offset - bucketBegin == endpoints.size();
+        }
+
+        if (isSameDigit) {
+            continue;
+        }
+
+        RunInThreads(threadsCount, [&] (int thread) {
+            auto* threadOffsets = offsets.data() + thread * Buckets;
+            auto [begin, end] = getChunk(thread);
+            for (auto i = begin; i < end; ++i) {
+                buffer[threadOffsets[(endpoints[i].Key >> shift) & (Buckets - 1)]++] = endpoints[i];
+            }
+        });
+
+        endpoints.swap(buffer);
+    }
+}
+
+// Reuses memory of the queue, so that many small inputs are swept without
+// allocations. Endpoint events of large inputs are made and sorted by
+// threadsCount threads.
+void FillEventQueue(std::span<const TSegment> input, TEventQueue& queue, int threadsCount = 1)
+{
+    static constexpr size_t MinSegmentsPerThread = 1 << 16;
+    static constexpr size_t MinRadixSortSize = 1 << 12;
+
+    Verify(input.size() <= std::numeric_limits<uint32_t>::max());
+
+    queue.Input = input.data();
+    queue.Position = 0;
+    while (!queue.Intersections.empty()) {
+        queue.Intersections.pop();
+    }
+
+    threadsCount = std::clamp<int>(input.size() / MinSegmentsPerThread, 1, std::max(threadsCount, 1));
+
+    queue.Endpoints.resize(2 * input.size());
+    RunInThreads(threadsCount, [&] (int thread) {
+        auto end = input.size() * (thread + 1) / threadsCount;
+        for (auto i = input.size() * thread / threadsCount; i < end; ++i) {
+            auto segment = static_cast<uint32_t>(i);
+            queue.Endpoints[2 * i] = {.Key = TEndpoint::MakeKey(ToIntegerPoint(input[i].Begin)), .Segment = segment, .IsEnd = false};
+            queue.Endpoints[2 * i + 1] = {.Key = TEndpoint::MakeKey(ToIntegerPoint(input[i].End)), .Segment = segment, .IsEnd = true};
+        }
+    });
+
+    if (queue.Endpoints.size() < MinRadixSortSize) {
+        std::sort(queue.Endpoints.begin(), queue.Endpoints.end(), [] (const TEndpoint& left, const TEndpoint& right) {
+            return left.Key < right.Key;
+        });
+    } else {
+        RadixSortEndpoints(queue.Endpoints, queue.SortBuffer, threadsCount);
+    }
+}
+
+TEventQueue MakeEventQueue(
+    std::span<const TSegment> input,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+    int threadsCount = 1)
+{
+    TEventQueue result(resource);
+    FillEventQueue(input, result, threadsCount);
+    return result;
+}
+
+// Part of the plane between two vertical lines, Left is inclusive and Right is
+// not. Missing bound means the slab is not limited from that side.
+struct TSlab
+{
+    std::optional<int64_t> Left;
+    std::optional<int64_t> Right;
+
+    bool IsBefore(const TExactPoint& point) const
+    {
+        return Left && point.X < *Left * point.Denominator;
+    }
+
+    bool IsAfter(const TExactPoint& point) const
+    {
+        return Right && point.X >= *Right * point.Denominator;
+    }
+
+    bool Contains(const TExactPoint& point) const
+    {
+        return !IsBefore(point) && !IsAfter(point);
+    }
+
+    bool Overlaps(const TSegment& segment) const
+    {
+        return (!Left || segment.End.X >= *Left) && (!Right || segment.Begin.X < *Right);
+    }
+};
+
+// Segments which begin to the left of the vertical line and end on it or to the
+// right, ordered from bottom to top right before the line. Segments meeting on
+// the line are ordered by slope, the steepest one is the lowest before it.
+std::vector<const TSegment*> GetCrossingOrder(std::span<const TSegment> input, int64_t x)
+{
+    struct TCrossing
+    {
+        const TSegment* Segment = nullptr;
+        TTrackingSegment Tracking;
+        // Y on the line is YNumerator / DX, DX is positive.
+        TInt128 YNumerator = 0;
+        TInt128 DX = 0;
+    };
+
+    std::vector<TCrossing> crossings;
+    for (const auto& segment : input) {
+        TTrackingSegment tracking(&segment);
+        if (tracking.Begin.X < x && x <= tracking.End.X) {
+            TInt128 dx = tracking.End.X - tracking.Begin.X;
+            crossings.push_back({
+                .Segment = &segment,
+                .Tracking = tracking,
+                .YNumerator = tracking.Begin.Y * dx + TInt128(tracking.End.Y - tracking.Begin.Y) * (x - tracking.Begin.X),
+                .DX = dx,
+            });
+        }
+    }
+
+    std::sort(crossings.begin(), crossings.end(), [] (const TCrossing& left, const TCrossing& right) {
+        if (auto y = left.YNumerator * right.DX <=> right.YNumerator * left.DX; y != 0) {
+            return y < 0;
+        }
+        if (auto slope = left.Tracking.CompareSlope(right.Tracking); slope != 0) {
+            return slope > 0;
+        }
+        return left.Segment < right.Segment;
+    });
+
+    std::vector<const TSegment*> result;
+    result.reserve(crossings.size());
+    for (const auto& crossing : crossings) {
+        result.push_back(crossing.Segment);
+    }
+    return result;
+}
+
+// Streams every intersection point to the sink as soon as it is handled:
+// sink(const TExactPoint& point, const std::vector<int>& segments), where the
+// segments are indices in the input. Every point is reported exactly once and
+// nothing is accumulated, so memory does not depend on the number of
+// intersections. Reports only intersections inside of the slab: the sweep
+// starts right before its left side with the segments crossing it already on
+// the sweep line, and stops at its right side. All state of the sweep is
+// allocated from one arena sized for the endpoints, which is released at once
+// when the sweep is over. Endpoint events are prepared by threadsCount threads,
+// the sweep itself is sequential.
+//
+// If layerSize is given, the input is two layers, the first layerSize segments
+// and the rest, and segments of a layer are known to meet only at common
+// endpoints. Pairs of the same layer are not tested then, so only points where
+// the layers meet are found, and they are reported with all segments having an
+// endpoint there.
+template <class TSink>
+void ReportIntersections(
+    std::span<const TSegment> input,
+    TSink&& sink,
+    TSweepStats* stats = nullptr,
+    TSlab slab = {},
+    int threadsCount = 1,
+    std::optional<int> layerSize = {})
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::pmr::monotonic_buffer_resource resource(
+        input.size() * (4 * sizeof(TEndpoint) + sizeof(int)) + (1 << 16));
+
+    auto queue = MakeEventQueue(input, &resource, threadsCount);
+
+    auto sweepStart = std::chrono::steady_clock::now();
+    if (stats) {
+        stats->SetupSeconds += std::chrono::duration<double>(sweepStart - start).count();
+    }
+
+    TSweepingLine sweepLine(input, &resource);
+    TEvent event(&resource);
+    std::vector<int> segmentIndices;
+
+    auto isSameLayer = [&] (const TSegment* left, const TSegment* right) {
+        return layerSize && (left - input.data() < *layerSize) == (right - input.data() < *layerSize);
+    };
+
+    auto handleIntersections = [&] (const TExactPoint& eventPoint, const TSegment* left, const TSegment* right) {
+        if (left == nullptr || right == nullptr || isSameLayer(left, right)) {
+            return;
+        }
+        auto intersection = GetExactIntersection(*left, *right);
+        if (!intersection || *intersection < eventPoint) {
+            return;
+        }
+
+        TRACE(FoundIntersection, left - input.data(), right - input.data());
+
+        if (*intersection == eventPoint) {
+            event.AddIntersecting(left);
+            event.AddIntersecting(right);
+            return;
+        }
+
+        if (slab.IsAfter(*intersection)) {
+            return;
+        }
+
+        queue.AddIntersection(*intersection, left, right);
+    };
+
+    auto addSegment = [&] (const TSegment* segment, const TExactPoint& eventPoint) {
+        TRACE(AddSegment, segment - input.data());
+        sweepLine.Add(segment, eventPoint);
+
+        for (const auto* neighbor : sweepLine.GetNeighbors(segment)) {
+            TRACE(CheckNeighbor, segment - input.data(), neighbor ? neighbor - input.data() : -1);
+            handleIntersections(eventPoint, segment, neighbor);
+        }
+    };
+
+    // Below every point of the left side, so intersections on the side are
+    // still ahead.
+    if (slab.Left) {
+        TExactPoint start{.X = *slab.Left, .Y = -MaxCoordinate - 1};
+        sweepLine.MoveTo(start);
+
+        const TSegment* previous = nullptr;
+        for (const auto* segment : GetCrossingOrder(input, *slab.Left)) {
+            sweepLine.AddLast(segment);
+            handleIntersections(start, previous, segment);
+            previous = segment;
+        }
+
+        queue.SkipBefore(*slab.Left);
+    }
+
+    while(!queue.Empty()) {
+        queue.Pop(event);
+        const auto& eventPoint = event.Point;
+
+        if (slab.IsAfter(eventPoint)) {
+            break;
+        }
+
+        if (stats) {
+            ++stats->Events;
+            stats->IntersectionEvents += !event.Intersecting.empty();
+        }
+
+        for (const auto* segment : event.Starting) {
+            addSegment(segment, eventPoint);
+        }
+
+        // Reinsertion may find the same intersection again, it is already handled.
+        auto intersectingCount = std::ssize(event.Intersecting);
+        segmentIndices.clear();
+
+        for (int i = 0; i < intersectingCount; ++i) {
+            const auto* segment = event.Intersecting[i];
+            TRACE(HandleIntersection, segment - input.data());
+            segmentIndices.push_back(segment - input.data());
+            sweepLine.Remove(segment);
+        }
+
+        // Segments of a layer ending or starting at the point may have been
+        // tested only against the same layer, which is skipped.
+        if (intersectingCount > 0 && layerSize) {
+            for (const auto* segments : {&event.Starting, &event.Ending}) {
+                for (const auto* segment : *segments) {
+                    if (std::find(event.Intersecting.begin(), event.Intersecting.end(), segment) == event.Intersecting.end()) {
+                        segmentIndices.push_back(segment - input.data());
+                    }
+                }
+            }
+        }
+
+        if (intersectingCount > 0 && slab.Contains(eventPoint)) {
+            sink(eventPoint, segmentIndices);
+        }
+
+        // Segments are reinserted in the order right after the intersection point.
+        for (int i = 0; i < intersectingCount; ++i) {
+            addSegment(event.Intersecting[i], eventPoint);
+        }
+
+        for (const auto* segment : event.Ending) {
+            TRACE(RemoveSegment, segment - input.data());
+            auto [before, after] = sweepLine.GetNeighbors(segment);
+            sweepLine.Remove(segment);
+            handleIntersections(eventPoint, before, after);
+        }
+    }
+
+    if (stats) {
+        stats->SweepSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - sweepStart).count();
+    }
+}
+
+// Collects reported intersections in the map, which copies every intersecting
+// segment per point. Use ReportIntersections for large outputs.
+TIntersections SweepLine(std::span<const TSegment> input, TSweepStats* stats = nullptr, TSlab slab = {}, int threadsCount = 1)
+{
+    TIntersections result;
+
+    ReportIntersections(input, [&] (const TExactPoint& point, const std::vector<int>& segments) {
+        auto& pointSegments = result[point.ToPoint()];
+        for (auto index : segments) {
+            pointSegments.insert(input[index]);
+        }
+    }, stats, slab, threadsCount);
+
+    return result;
+}
+
+using TPmrIntersections = std::pmr::map<TPoint, std::pmr::set<TSegment>>;
+
+// Same as SweepLine, but the map and its sets are allocated from the resource
+// of the caller. With a monotonic resource the result is freed in one shot.
+TPmrIntersections SweepLine(std::span<const TSegment> input, std::pmr::memory_resource* resource)
+{
+    TPmrIntersections result(resource);
+
+    ReportIntersections(input, [&] (const TExactPoint& point, const std::vector<int>& segments) {
+        auto& pointSegments = result[point.ToPoint()];
+        for (auto index : segments) {
+            pointSegments.insert(input[index]);
+        }
+    });
+
+    return result;
+}
+
+struct TIntersectionsCount
+{
+    int64_t Points = 0;
+    // Sum of the number of segments through every intersection point.
+    int64_t Incidences = 0;
+};
+
+TIntersectionsCount CountIntersections(std::span<const TSegment> input, TSweepStats* stats = nullptr, int threadsCount = 1)
+{
+    TIntersectionsCount result;
+
+    ReportIntersections(input, [&] (const TExactPoint&, const std::vector<int>& segments) {
+        ++result.Points;
+        result.Incidences += std::ssize(segments);
+    }, stats, {}, threadsCount);
+
+    return result;
+}
+
+enum class ELayers
+{
+    // Segments of a layer may cross each other.
+    MayCross,
+    // Segments of a layer meet only at common endpoints, as edges of a planar
+    // subdivision or of a planar network do. The caller guarantees it.
+    CrossingFree,
+};
+
+// Reports intersection points where segments of both layers meet:
+// sink(const TExactPoint& point, const std::vector<int>& red, const std::vector<int>& blue),
+// indices are in the corresponding layer. If layers may cross, pairs of the
+// same layer still have to be checked: otherwise the sweep line order becomes
+// stale after a crossing and bichromatic intersections are lost, so
+// monochromatic points are handled for the order only and never reported. For
+// crossing-free layers pairs of the same layer are skipped.
+template <class TSink>
+void ReportRedBlueIntersections(
+    const std::vector<TSegment>& red,
+    const std::vector<TSegment>& blue,
+    TSink&& sink,
+    TSweepStats* stats = nullptr,
+    ELayers layers = ELayers::MayCross)
+{
+    std::vector<TSegment> input;
+    input.reserve(red.size() + blue.size());
+    input.insert(input.end(), red.begin(), red.end());
+    input.insert(input.end(), blue.begin(), blue.end());
+
+    int redCount = std::ssize(red);
+    std::vector<int> redIndices;
+    std::vector<int> blueIndices;
+
+    ReportIntersections(input, [&] (const TExactPoint& point, const std::vector<int>& segments) {
+        redIndices.clear();
+        blueIndices.clear();
+        for (auto index : segments) {
+            if (index < redCount) {
+                redIndices.push_back(index);
+            } else {
+                blueIndices.push_back(index - redCount);
+            }
+        }
+
+        if (!redIndices.empty() && !blueIndices.empty()) {
+            sink(point, redIndices, blueIndices);
+        }
+    }, stats, {}, 1, layers == ELayers::CrossingFree ? std::optional(redCount) : std::nullopt);
+}
+
+TIntersections RedBlueSweepLine(const std::vector<TSegment>& red, const std::vector<TSegment>& blue, ELayers layers = ELayers::MayCross)
+{
+    TIntersections result;
+
+    ReportRedBlueIntersections(red, blue, [&] (const TExactPoint& point, const std::vector<int>& redIndices, const std::vector<int>& blueIndices) {
+        auto& pointSegments = result[point.ToPoint()];
+        for (auto index : redIndices) {
+            pointSegments.insert(red[index]);
+        }
+        for (auto index : blueIndices) {
+            pointSegments.insert(blue[index]);
+        }
+    }, nullptr, layers);
+
+    return result;
+}
+
+// Shamos-Hoey test: finds some two segments for which intersects(left, right)
+// holds. The leftmost such pair is found between neighbors on the sweep line
+// before the sweep passes it, so only endpoints are processed and no
+// intersection events are scheduled. Buffers are kept between calls.
+struct TAnyIntersectionFinder
+{
+    TEventQueue Queue;
+    TSweepingLine SweepLine;
+    TEvent Event;
+
+    template <class TPredicate>
+    std::optional<std::pair<int, int>> Find(std::span<const TSegment> input, TPredicate&& intersects)
+    {
+        FillEventQueue(input, Queue);
+        SweepLine.Reset(input);
+
+        auto check = [&] (const TSegment* left, const TSegment* right) {
+            return left != nullptr && right != nullptr && intersects(*left, *right);
+        };
+
+        auto witness = [&] (const TSegment* left, const TSegment* right) {
+            return std::pair<int, int>(left - input.data(), right - input.data());
+        };
+
+        while(!Queue.Empty()) {
+            Queue.Pop(Event);
+
+            // Segments ending at the event point are still on the sweep line, so
+            // touching at the endpoint is found when the next segment is added.
+            for (const auto* segment : Event.Starting) {
+                SweepLine.Add(segment, Event.Point);
+
+                for (const auto* neighbor : SweepLine.GetNeighbors(segment)) {
+                    if (check(segment, neighbor)) {
+                        return witness(segment, neighbor);
+                    }
+                }
+            }
+
+            for (const auto* segment : Event.Ending) {
+                auto [before, after] = SweepLine.GetNeighbors(segment);
+                SweepLine.Remove(segment);
+
+                if (check(before, after)) {
+                    return witness(before, after);
+                }
+            }
+        }
+
+        return {};
+    }
+};
+
+// Returns indices of some two intersecting segments or nothing if there are no intersections.
+std::optional<std::pair<int, int>> FindAnyIntersection(std::span<const TSegment> input)
+{
+    TAnyIntersectionFinder finder;
+    return finder.Find(input, [] (const TSegment& left, const TSegment& right) {
+        return GetExactIntersection(left, right).has_value();
+    });
+}
+
+///////////////////////////////////////////////////////////////////////
+
+// Unlike GetExactIntersection, overlapping collinear segments do touch.
+bool Touches(const TSegment& first, const TSegment& second)
+{
+    auto a1 = ToIntegerPoint(first.Begin);
+    auto a2 = ToIntegerPoint(first.End);
+    auto b1 = ToIntegerPoint(second.Begin);
+    auto b2 = ToIntegerPoint(second.End);
+
+    auto o1 = Orientation(a1, a2, b1);
+    auto o2 = Orientation(a1, a2, b2);
+    auto o3 = Orientation(b1, b2, a1);
+    auto o4 = Orientation(b1, b2, a2);
+
+    if (o1 == 0 && o2 == 0) {
+        return std::max(a1.X, a2.X) >= std::min(b1.X, b2.X) && std::max(b1.X, b2.X) >= std::min(a1.X, a2.X)
+            && std::max(a1.Y, a2.Y) >= std::min(b1.Y, b2.Y) && std::max(b1.Y, b2.Y) >= std::min(a1.Y, a2.Y);
+    }
+
+    return o1 * o2 <= 0 && o3 * o4 <= 0;
+}
+
+enum class ERingStatus
+{
+    Simple,
+    TooFewVertices,
+    RepeatedVertex,
+    SelfIntersection,
+};
+
+// Checks that closed rings are simple: consecutive edges meet only at their
+// common vertex and other edges do not touch at all. Many rings are validated
+// by one validator, so memory of the sweep is allocated once per batch.
+struct TRingValidator
+{
+    // Smaller rings are checked pairwise, the sweep does not pay off for them.
+    static constexpr int MaxBruteForceEdges = 32;
+
+    std::vector<TSegment> Edges;
+    TAnyIntersectionFinder Finder;
+
+    ERingStatus Validate(const std::vector<TPoint>& ring)
+    {
+        if (auto status = PrepareEdges(ring); status != ERingStatus::Simple) {
+            return status;
+        }
+
+        auto crossing = std::ssize(Edges) <= MaxBruteForceEdges ? HasCrossingBruteForce() : HasCrossingSweep();
+        return crossing ? ERingStatus::SelfIntersection : ERingStatus::Simple;
+    }
+
+    // Fills Edges and checks everything except touching of non-consecutive
+    // edges. The sweep relies on consecutive edges not overlapping.
+    ERingStatus PrepareEdges(const std::vector<TPoint>& ring)
+    {
+        Edges.clear();
+
+        auto verticesCount = std::ssize(ring);
+        if (verticesCount > 1 && ring.front() == ring.back()) {
+            --verticesCount;
+        }
+
+        if (verticesCount < 3) {
+            return ERingStatus::TooFewVertices;
+        }
+
+        for (int i = 0; i < verticesCount; ++i) {
+            TSegment edge {.Begin = ring[i], .End = ring[(i + 1) % verticesCount]};
+            edge.Normalize();
+            if (edge.Begin == edge.End) {
+                return ERingStatus::RepeatedVertex;
+            }
+            Edges.push_back(edge);
+        }
+
+        // Consecutive collinear edges may overlap only if the ring turns back.
+        for (int i = 0; i < verticesCount; ++i) {
+            auto previous = ToIntegerPoint(ring[(i + verticesCount - 1) % verticesCount]);
+            auto current = ToIntegerPoint(ring[i]);
+            auto next = ToIntegerPoint(ring[(i + 1) % verticesCount]);
+
+            auto turnsBack = (previous.X - current.X) * (next.X - current.X) + (previous.Y - current.Y) * (next.Y - current.Y) > 0;
+            if (Orientation(previous, current, next) == 0 && turnsBack) {
+                return ERingStatus::SelfIntersection;
+            }
+        }
+
+        return ERingStatus::Simple;
+    }
+
+    bool IsAdjacent(int first, int second) const
+    {
+        auto distance = std::abs(first - second);
+        return distance == 1 || distance == std::ssize(Edges) - 1;
+    }
+
+    bool HasCrossingBruteForce() const
+    {
+        for (int i = 0; i < std::ssize(Edges); ++i) {
+            for (int j = i + 2; j < std::ssize(Edges); ++j) {
+                if (!IsAdjacent(i, j) && Touches(Edges[i], Edges[j])) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    bool HasCrossingSweep()
+    {
+        const auto* edges = Edges.data();
+        return Finder.Find(Edges, [&] (const TSegment& left, const TSegment& right) {
+            return !IsAdjacent(&left - edges, &right - edges) && Touches(left, right);
+        }).has_value();
+    }
+
+    std::vector<ERingStatus> Validate(const std::vector<std::vector<TPoint>>& rings)
+    {
+        std::vector<ERingStatus> result;
+        result.reserve(rings.size());
+
+        for (const auto& ring : rings) {
+            result.push_back(Validate(ring));
+        }
+
+        return result;
+    }
+};
+
+// Uniform grid over segment bounding boxes, every segment is put into all cells
+// overlapped by its box. Boxes are copied next to the segment indices, so the
+// boxes of a cell are contiguous and are tested without indirection.
+struct TSegmentGrid
+{
+    static constexpr int SegmentsPerCell = 4;
+    static constexpr int MaxCellsPerSegment = 4;
+
+    TIntegerPoint Min;
+    int64_t CellSide = 1;
+    int CellsX = 0;
+    int CellsY = 0;
+
+    // Entries of the cell c = y * CellsX + x are [CellStart[c], CellStart[c + 1]).
+    std::vector<int> CellStart;
+    std::vector<int> Segments;
+    std::vector<int32_t> MinX;
+    std::vector<int32_t> MinY;
+    std::vector<int32_t> MaxX;
+    std::vector<int32_t> MaxY;
+
+    int GetCellX(int64_t x) const
+    {
+        return std::clamp(static_cast<int>((x - Min.X) / CellSide), 0, CellsX - 1);
+    }
+
+    int GetCellY(int64_t y) const
+    {
+        return std::clamp(static_cast<int>((y - Min.Y) / CellSide), 0, CellsY - 1);
+    }
+
+    int GetCell(int cellX, int cellY) const
+    {
+        return cellY * CellsX + cellX;
+    }
+};
+
+TSegmentGrid ConstructSegmentGrid(const std::vector<TSegment>& input)
+{
+    TSegmentGrid grid;
+
+    std::vector<std::array<TIntegerPoint, 2>> boxes;
+    boxes.reserve(input.size());
+    for (const auto& segment : input) {
+        auto begin = ToIntegerPoint(segment.Begin);
+        auto end = ToIntegerPoint(segment.End);
+        boxes.push_back({
+            TIntegerPoint{.X = std::min(begin.X, end.X), .Y = std::min(begin.Y, end.Y)},
+            TIntegerPoint{.X = std::max(begin.X, end.X), .Y = std::max(begin.Y, end.Y)},
+        });
+    }
+
+    auto max = boxes.front()[1];
+    grid.Min = boxes.front()[0];
+    double extent = 0;
+    for (const auto& [lower, upper] : boxes) {
+        grid.Min.X = std::min(grid.Min.X, lower.X);
+        grid.Min.Y = std::min(grid.Min.Y, lower.Y);
+        max.X = std::max(max.X, upper.X);
+        max.Y = std::max(max.Y, upper.Y);
+        extent += std::max(upper.X - lower.X, upper.Y - lower.Y);
+    }
+
+    // Square cells holding SegmentsPerCell segments on average, but not much
+    // smaller than segments, so that a segment overlaps only a few cells.
+    double width = static_cast<double>(max.X - grid.Min.X + 1);
+    double height = static_cast<double>(max.Y - grid.Min.Y + 1);
+    double cellSide = std::max(
+        std::sqrt(width * height * TSegmentGrid::SegmentsPerCell / std::ssize(input)),
+        extent / std::ssize(input) / std::sqrt(TSegmentGrid::MaxCellsPerSegment));
+
+    grid.CellSide = std::max<int64_t>(1, std::ceil(std::min(cellSide, std::max(width, height))));
+    grid.CellsX = static_cast<int>(std::ceil(width / grid.CellSide));
+    grid.CellsY = static_cast<int>(std::ceil(height / grid.CellSide));
+
+    TRACE(GridCells, grid.CellsX, grid.CellsY, grid.CellSide, std::llround(cellSide * 1000000));
+
+    auto forEachCell = [&] (const std::array<TIntegerPoint, 2>& box, auto&& callback) {
+        for (int cellY = grid.GetCellY(box[0].Y); cellY <= grid.GetCellY(box[1].Y); ++cellY) {
+            for (int cellX = grid.GetCellX(box[0].X); cellX <= grid.GetCellX(box[1].X); ++cellX) {
+                callback(grid.GetCell(cellX, cellY));
+            }
+        }
+    };
+
+    grid.CellStart.assign(static_cast<size_t>(grid.CellsX) * grid.CellsY + 1, 0);
+    for (const auto& box : boxes) {
+        forEachCell(box, [&] (int cell) {
+            ++grid.CellStart[cell + 1];
+        });
+    }
+
+    for (int i = 1; i < std::ssize(grid.CellStart); ++i) {
+        grid.CellStart[i] += grid.CellStart[i - 1];
+    }
+
+    auto entriesCount = grid.CellStart.back();
+    grid.Segments.resize(entriesCount);
+    grid.MinX.resize(entriesCount);
+    grid.MinY.resize(entriesCount);
+    grid.MaxX.resize(entriesCount);
+    grid.MaxY.resize(entriesCount);
+
+    std::vector<int> position(grid.CellStart.begin(), grid.CellStart.end() - 1);
+    for (int i = 0; i < std::ssize(boxes); ++i) {
+        forEachCell(boxes[i], [&] (int cell) {
+            auto entry = position[cell]++;
+            grid.Segments[entry] = i;
+            grid.MinX[entry] = boxes[i][0].X;
+            grid.MinY[entry] = boxes[i][0].Y;
+            grid.MaxX[entry] = boxes[i][1].X;
+            grid.MaxY[entry] = boxes[i][1].Y;
+        });
+    }
+
+    return grid;
+}
+
+// Broad phase for many short segments: only pairs of segments from the same
+// cell with overlapping bounding boxes are intersected exactly. A pair sharing
+// several cells is handled only in the cell containing the lower left corner
+// of the intersection of their boxes, so no pair is tested twice.
+TIntersections GridIntersections(const std::vector<TSegment>& input)
+{
+    TIntersections result;
+    if (input.empty()) {
+        return result;
+    }
+
+    auto grid = ConstructSegmentGrid(input);
+    std::vector<uint8_t> overlaps;
+
+    for (int cell = 0; cell + 1 < std::ssize(grid.CellStart); ++cell) {
+        auto begin = grid.CellStart[cell];
+        auto end = grid.CellStart[cell + 1];
+
+        for (int i = begin; i < end; ++i) {
+            auto minX = grid.MinX[i];
+            auto minY = grid.MinY[i];
+            auto maxX = grid.MaxX[i];
+            auto maxY = grid.MaxY[i];
+
+            // Branch free, so the box test is vectorized (-O3 or -ftree-vectorize).
+            overlaps.resize(end - i);
+            for (int j = i + 1; j < end; ++j) {
+                overlaps[j - i] = (grid.MinX[j] <= maxX) & (grid.MaxX[j] >= minX)
+                    & (grid.MinY[j] <= maxY) & (grid.MaxY[j] >= minY);
+            }
+
+            for (int j = i + 1; j < end; ++j) {
+                if (!overlaps[j - i]) {
+                    continue;
+                }
+
+                auto referenceX = grid.GetCellX(std::max(minX, grid.MinX[j]));
+                auto referenceY = grid.GetCellY(std::max(minY, grid.MinY[j]));
+                if (grid.GetCell(referenceX, referenceY) != cell) {
+                    continue;
+                }
+
+                const auto& first = input[grid.Segments[i]];
+                const auto& second = input[grid.Segments[j]];
+                auto intersection = GetExactIntersection(first, second);
+                if (!intersection) {
+                    continue;
+                }
+
+                auto& segments = result[intersection->ToPoint()];
+                segments.insert(first);
+                segments.insert(second);
+            }
+        }
+    }
+
+    return result;
+}
+
+struct TBox
+{
+    TIntegerPoint Min;
+    TIntegerPoint Max;
+
+    static TBox FromSegment(const TSegment& segment)
+    {
+        auto begin = ToIntegerPoint(segment.Begin);
+        auto end = ToIntegerPoint(segment.End);
+        return {
+            .Min = {.X = std::min(begin.X, end.X), .Y = std::min(begin.Y, end.Y)},
+            .Max = {.X = std::max(begin.X, end.X), .Y = std::max(begin.Y, end.Y)},
+        };
+    }
+
+    bool Overlaps(const TBox& other) const
+    {
+        return Min.X <= other.Max.X && other.Min.X <= Max.X
+            && Min.Y <= other.Max.Y && other.Min.Y <= Max.Y;
+    }
+
+    bool Contains(TIntegerPoint point) const
+    {
+        return Min.X <= point.X && point.X <= Max.X && Min.Y <= point.Y && point.Y <= Max.Y;
+    }
+
+    void Extend(const TBox& other)
+    {
+        Min.X = std::min(Min.X, other.Min.X);
+        Min.Y = std::min(Min.Y, other.Min.Y);
+        Max.X = std::max(Max.X, other.Max.X);
+        Max.Y = std::max(Max.Y, other.Max.Y);
+    }
+};
+
+// Closed window is crossed by the segment if their bounding boxes overlap and
+// the line of the segment does not leave all corners of the window strictly on
+// one side, these are the only axes which can separate a segment and a box.
+// Exact, also for windows of zero width or height.
+bool Intersects(const TSegment& segment, const TBox& window)
+{
+    if (!TBox::FromSegment(segment).Overlaps(window)) {
+        return false;
+    }
+
+    auto begin = ToIntegerPoint(segment.Begin);
+    auto end = ToIntegerPoint(segment.End);
+    TIntegerPoint corners[] = {
+        {.X = window.Min.X, .Y = window.Min.Y},
+        {.X = window.Max.X, .Y = window.Min.Y},
+        {.X = window.Max.X, .Y = window.Max.Y},
+        {.X = window.Min.X, .Y = window.Max.Y},
+    };
+
+    bool hasLeft = false;
+    bool hasRight = false;
+    for (const auto& corner : corners) {
+        auto side = Orientation(begin, end, corner);
+        if (side == 0) {
+            return true;
+        }
+        hasLeft |= side > 0;
+        hasRight |= side < 0;
+    }
+
+    return hasLeft && hasRight;
+}
+
+// Lower bound of the distance from the point to anything inside of the box.
+double SquaredDistance(const TPoint& point, const TBox& box)
+{
+    double dx = std::max({box.Min.X - point.X, 0.0, point.X - box.Max.X});
+    double dy = std::max({box.Min.Y - point.Y, 0.0, point.Y - box.Max.Y});
+    return dx * dx + dy * dy;
+}
+
+// Distance to the projection of the point onto the segment clamped to its ends.
+double SquaredDistance(const TPoint& point, const TSegment& segment)
+{
+    double dx = segment.End.X - segment.Begin.X;
+    double dy = segment.End.Y - segment.Begin.Y;
+    double lengthSquared = dx * dx + dy * dy;
+
+    double t = 0;
+    if (lengthSquared > 0) {
+        t = std::clamp(((point.X - segment.Begin.X) * dx + (point.Y - segment.Begin.Y) * dy) / lengthSquared, 0.0, 1.0);
+    }
+
+    double x = segment.Begin.X + t * dx - point.X;
+    double y = segment.Begin.Y + t * dy - point.Y;
+    return x * x + y * y;
+}
+
+// R-tree bulk loaded by Sort-Tile-Recursive packing: boxes are sorted by x,
+// cut into vertical slices, every slice is sorted by y and packed into full
+// nodes. Levels are built bottom up and stored in one array, children of a
+// node are contiguous. Boxes are filtered by the tree and refined exactly.
+struct TSegmentRTree
+{
+    static constexpr int NodeCapacity = 16;
+
+    struct TNode
+    {
+        TBox Box;
+        // Children are Nodes[First, First + Count) or, for leaves, Entries.
+        int First = 0;
+        int Count = 0;
+        bool IsLeaf = false;
+    };
+
+    struct TEntry
+    {
+        TBox Box;
+        int Segment = 0;
+    };
+
+    std::vector<TEntry> Entries;
+    // Copies of the input segments in the order of Entries, so the tree does not
+    // depend on the input and leaves read their segments sequentially.
+    std::vector<TSegment> Segments;
+    std::vector<TNode> Nodes;
+    int Root = -1;
+
+    explicit TSegmentRTree(const std::vector<TSegment>& input)
+    {
+        if (input.empty()) {
+            return;
+        }
+
+        Entries.reserve(input.size());
+        for (int i = 0; i < std::ssize(input); ++i) {
+            Entries.push_back({.Box = TBox::FromSegment(input[i]), .Segment = i});
+        }
+        Pack(Entries);
+
+        Segments.reserve(input.size());
+        for (const auto& entry : Entries) {
+            Segments.push_back(input[entry.Segment]);
+        }
+
+        std::vector<TNode> level;
+        for (int first = 0; first < std::ssize(Entries); first += NodeCapacity) {
+            level.push_back(MakeNode(Entries, first, true));
+        }
+
+        while (level.size() > 1) {
+            Pack(level);
+
+            auto first = std::ssize(Nodes);
+            Nodes.insert(Nodes.end(), level.begin(), level.end());
+
+            std::vector<TNode> parents;
+            for (int i = 0; i < std::ssize(level); i += NodeCapacity) {
+                auto parent = MakeNode(level, i, false);
+                parent.First += first;
+                parents.push_back(parent);
+            }
+            level = std::move(parents);
+        }
+
+        Root = std::ssize(Nodes);
+        Nodes.push_back(level.front());
+    }
+
+    template <class T>
+    static TNode MakeNode(const std::vector<T>& children, int first, bool isLeaf)
+    {
+        TNode node {
+            .Box = children[first].Box,
+            .First = first,
+            .Count = std::min<int>(NodeCapacity, std::ssize(children) - first),
+            .IsLeaf = isLeaf,
+        };
+
+        for (int i = first; i < first + node.Count; ++i) {
+            node.Box.Extend(children[i].Box);
+        }
+
+        return node;
+    }
+
+    template <class T>
+    static void Pack(std::vector<T>& items)
+    {
+        auto centerX = [] (const T& item) { return item.Box.Min.X + item.Box.Max.X; };
+        auto centerY = [] (const T& item) { return item.Box.Min.Y + item.Box.Max.Y; };
+
+        std::sort(items.begin(), items.end(), [&] (const T& left, const T& right) {
+            return centerX(left) < centerX(right);
+        });
+
+        auto nodesCount = (std::ssize(items) + NodeCapacity - 1) / NodeCapacity;
+        auto slicesCount = static_cast<int64_t>(std::ceil(std::sqrt(static_cast<double>(nodesCount))));
+        auto sliceSize = slicesCount * NodeCapacity;
+
+        for (int64_t first = 0; first < std::ssize(items); first += sliceSize) {
+            auto last = std::min(first + sliceSize, std::ssize(items));
+            std::sort(items.begin() + first, items.begin() + last, [&] (const T& left, const T& right) {
+                return centerY(left) < centerY(right);
+            });
+        }
+    }
+
+    // Calls callback(entry) for every entry whose box overlaps the box.
+    template <class TCallback>
+    void Traverse(const TBox& box, TCallback&& callback) const
+    {
+        if (Root < 0 || !Nodes[Root].Box.Overlaps(box)) {
+            return;
+        }
+
+        std::vector<int> stack{Root};
+        while (!stack.empty()) {
+            const auto& node = Nodes[stack.back()];
+            stack.pop_back();
+
+            for (int i = node.First; i < node.First + node.Count; ++i) {
+                if (node.IsLeaf) {
+                    if (Entries[i].Box.Overlaps(box)) {
+                        callback(i);
+                    }
+                } else if (Nodes[i].Box.Overlaps(box)) {
+                    stack.push_back(i);
+                }
+            }
+        }
+    }
+
+    void FindCrossing(const TSegment& query, std::vector<int>& results) const
+    {
+        Traverse(TBox::FromSegment(query), [&] (int entry) {
+            if (GetIntersection(Segments[entry], query)) {
+                results.push_back(Entries[entry].Segment);
+            }
+        });
+    }
+
+    void FindInWindow(const TBox& window, std::vector<int>& results) const
+    {
+        Traverse(window, [&] (int entry) {
+            if (Intersects(Segments[entry], window)) {
+                results.push_back(Entries[entry].Segment);
+            }
+        });
+    }
+
+    struct TNearest
+    {
+        int Segment = -1;
+        double SquaredDistance = std::numeric_limits<double>::infinity();
+    };
+
+    // Pairs of the distance to the node box and the node, ordered as a min-heap.
+    using TNearestHeap = std::vector<std::pair<double, int>>;
+
+    // Best-first search: nodes are visited in the order of distances to their
+    // boxes, which bound distances to all segments inside, until the closest
+    // box is farther than the closest segment found. Segments are checked
+    // exactly only if their own boxes are close enough. The heap is reused
+    // between queries.
+    TNearest FindNearest(const TPoint& point, TNearestHeap& heap) const
+    {
+        TNearest result;
+        if (Root < 0) {
+            return result;
+        }
+
+        heap.clear();
+        heap.emplace_back(SquaredDistance(point, Nodes[Root].Box), Root);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<>{});
+            auto [bound, index] = heap.back();
+            heap.pop_back();
+
+            if (bound >= result.SquaredDistance) {
+                break;
+            }
+
+            const auto& node = Nodes[index];
+            for (int i = node.First; i < node.First + node.Count; ++i) {
+                if (node.IsLeaf) {
+                    if (SquaredDistance(point, Entries[i].Box) >= result.SquaredDistance) {
+                        continue;
+                    }
+                    if (auto distance = SquaredDistance(point, Segments[i]); distance < result.SquaredDistance) {
+                        result = {.Segment = Entries[i].Segment, .SquaredDistance = distance};
+                    }
+                } else if (auto distance = SquaredDistance(point, Nodes[i].Box); distance < result.SquaredDistance) {
+                    heap.emplace_back(distance, i);
+                    std::push_heap(heap.begin(), heap.end(), std::greater<>{});
+                }
+            }
+        }
+
+        return result;
+    }
+
+    TNearest FindNearest(const TPoint& point) const
+    {
+        TNearestHeap heap;
+        return FindNearest(point, heap);
+    }
+
+    // Splits the batch into contiguous chunks, one per thread. The tree is
+    // read only, so threads share it without locks.
+    std::vector<TNearest> FindNearest(std::span<const TPoint> points, int threadsCount) const
+    {
+        static constexpr size_t MinQueriesPerThread = 1024;
+
+        std::vector<TNearest> result(points.size());
+        threadsCount = std::clamp<int>(points.size() / MinQueriesPerThread, 1, std::max(threadsCount, 1));
+
+        RunInThreads(threadsCount, [&] (int thread) {
+            TNearestHeap heap;
+            auto end = points.size() * (thread + 1) / threadsCount;
+            for (auto i = points.size() * thread / threadsCount; i < end; ++i) {
+                result[i] = FindNearest(points[i], heap);
+            }
+        });
+
+        return result;
+    }
+};
+
+// Intersections of a changing set of segments. Segments are bucketed by a
+// hashed uniform grid over their bounding boxes, so adding or removing a
+// segment touches only segments from the cells it overlaps, not the whole set.
+struct TIncrementalIntersections
+{
+    struct TCrossing
+    {
+        int Segment = 0;
+        TPoint Point;
+    };
+
+    int64_t CellSide = 1;
+    std::vector<TSegment> Segments;
+    std::vector<bool> IsAlive;
+    std::vector<int> FreeSlots;
+    std::unordered_map<int64_t, std::vector<int>> Cells;
+    // Crossings of every segment, both segments of a pair keep it.
+    std::vector<std::vector<TCrossing>> Crossings;
+    // Number of crossings of every segment at every point.
+    std::map<TPoint, std::map<int, int>> Points;
+    // Segments already checked by the current query.
+    std::vector<uint32_t> Visited;
+    uint32_t Stamp = 0;
+
+    explicit TIncrementalIntersections(int64_t cellSide)
+        : CellSide(cellSide)
+    { }
+
+    // Visits the cells crossed by the segment. Every row of cells is clipped to
+    // the x extent of the segment within the row, so a long diagonal segment
+    // visits O(length / CellSide) cells, not the cells of its whole bounding box.
+    template <class TCallback>
+    void ForEachCell(const TSegment& segment, TCallback&& callback) const
+    {
+        auto begin = ToIntegerPoint(segment.Begin);
+        auto end = ToIntegerPoint(segment.End);
+        if (end.Y < begin.Y) {
+            std::swap(begin, end);
+        }
+
+        auto cell = [&] (int64_t value) {
+            return (value + MaxCoordinate) / CellSide;
+        };
+        // Cell of the rational x of the segment at the height y.
+        auto cellAt = [&] (int64_t y) {
+            auto dy = end.Y - begin.Y;
+            auto shifted = static_cast<TInt128>(begin.X + MaxCoordinate) * dy + static_cast<TInt128>(end.X - begin.X) * (y - begin.Y);
+            return static_cast<int64_t>(shifted / (static_cast<TInt128>(CellSide) * dy));
+        };
+
+        for (auto cellY = cell(begin.Y); cellY <= cell(end.Y); ++cellY) {
+            auto minCellX = cell(std::min(begin.X, end.X));
+            auto maxCellX = cell(std::max(begin.X, end.X));
+            if (begin.Y != end.Y) {
+                // Crossing points are rational, so the row spans up to the
+                // bottom of the next row inclusive.
+                auto rowMin = cellY * CellSide - MaxCoordinate;
+                auto first = cellAt(std::max(begin.Y, rowMin));
+                auto last = cellAt(std::min(end.Y, rowMin + CellSide));
+                minCellX = std::min(first, last);
+                maxCellX = std::max(first, last);
+            }
+
+            for (auto cellX = minCellX; cellX <= maxCellX; ++cellX) {
+                callback(cellY << 32 | cellX);
+            }
+        }
+    }
+
+    // Returns id of the segment and reports its crossings with the stored ones.
+    int Insert(const TSegment& segment, std::vector<TCrossing>* newCrossings = nullptr)
+    {
+        int id = 0;
+        if (FreeSlots.empty()) {
+            id = std::ssize(Segments);
+            Segments.push_back(segment);
+            IsAlive.push_back(true);
+            Crossings.emplace_back();
+            Visited.push_back(0);
+        } else {
+            id = FreeSlots.back();
+            FreeSlots.pop_back();
+            Segments[id] = segment;
+            IsAlive[id] = true;
+        }
+
+        ++Stamp;
+        auto box = TBox::FromSegment(segment);
+        ForEachCell(segment, [&] (int64_t cell) {
+            auto& cellSegments = Cells[cell];
+            for (auto other : cellSegments) {
+                if (Visited[other] == Stamp || !box.Overlaps(TBox::FromSegment(Segments[other]))) {
+                    continue;
+                }
+                Visited[other] = Stamp;
+
+                auto intersection = GetExactIntersection(segment, Segments[other]);
+                if (!intersection) {
+                    continue;
+                }
+
+                auto point = intersection->ToPoint();
+                Crossings[id].push_back({.Segment = other, .Point = point});
+                Crossings[other].push_back({.Segment = id, .Point = point});
+                auto& pointSegments = Points[point];
+                ++pointSegments[id];
+                ++pointSegments[other];
+
+                if (newCrossings) {
+                    newCrossings->push_back({.Segment = other, .Point = point});
+                }
+            }
+            cellSegments.push_back(id);
+        });
+
+        return id;
+    }
+
+    void Remove(int id)
+    {
+        Verify(id >= 0 && id < std::ssize(Segments) && IsAlive[id]);
+
+        ForEachCell(Segments[id], [&] (int64_t cell) {
+            auto it = Cells.find(cell);
+            auto& cellSegments = it->second;
+            *std::find(cellSegments.begin(), cellSegments.end(), id) = cellSegments.back();
+            cellSegments.pop_back();
+            if (cellSegments.empty()) {
+                Cells.erase(it);
+            }
+        });
+
+        for (const auto& crossing : Crossings[id]) {
+            auto& otherCrossings = Crossings[crossing.Segment];
+            *std::find_if(otherCrossings.begin(), otherCrossings.end(), [&] (const TCrossing& other) {
+                return other.Segment == id;
+            }) = otherCrossings.back();
+            otherCrossings.pop_back();
+
+            auto it = Points.find(crossing.Point);
+            auto& pointSegments = it->second;
+            for (auto segment : {id, crossing.Segment}) {
+                if (--pointSegments[segment] == 0) {
+                    pointSegments.erase(segment);
+                }
+            }
+            if (pointSegments.empty()) {
+                Points.erase(it);
+            }
+        }
+
+        Crossings[id].clear();
+        IsAlive[id] = false;
+        FreeSlots.push_back(id);
+    }
+
+    TIntersections GetIntersections() const
+    {
+        TIntersections result;
+        for (const auto& [point, pointSegments] : Points) {
+            auto& segments = result[point];
+            for (const auto& [segment, count] : pointSegments) {
+                segments.insert(Segments[segment]);
+            }
+        }
+
+        return result;
+    }
+
+    std::vector<TSegment> GetSegments() const
+    {
+        std::vector<TSegment> result;
+        for (int i = 0; i < std::ssize(Segments); ++i) {
+            if (IsAlive[i]) {
+                result.push_back(Segments[i]);
+            }
+        }
+
+        return result;
+    }
+};
+
+// CPU times of the parallel sweep. With a core per slab the sweep takes split,
+// the longest slab and merge.
+struct TSlabStats
+{
+    double SplitSeconds = 0;
+    std::vector<double> SlabSeconds;
+    double MergeSeconds = 0;
+};
+
+double GetThreadSeconds()
+{
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Splits the plane into vertical slabs with equal number of segment endpoints
+// and sweeps every slab in its own thread. A slab sweep starts at the left side
+// of the slab, so the work of threads does not overlap. Every intersection is
+// reported only by the slab containing it, so results of slabs do not overlap.
+TIntersections SweepLineParallel(const std::vector<TSegment>& input, int threadsCount, TSlabStats* stats = nullptr)
+{
+    if (threadsCount <= 1 || input.empty()) {
+        return SweepLine(input);
+    }
+
+    auto start = GetThreadSeconds();
+
+    std::vector<int64_t> endpoints;
+    endpoints.reserve(2 * input.size());
+    for (const auto& segment : input) {
+        endpoints.push_back(ToIntegerPoint(segment.Begin).X);
+        endpoints.push_back(ToIntegerPoint(segment.End).X);
+    }
+
+    std::vector<TSlab> slabs(1);
+    auto selected = endpoints.begin();
+    for (int i = 1; i < threadsCount; ++i) {
+        auto position = endpoints.begin() + i * endpoints.size() / threadsCount;
+        std::nth_element(selected, position, endpoints.end());
+        selected = position;
+
+        auto boundary = *position;
+        if (slabs.back().Left && *slabs.back().Left >= boundary) {
+            continue;
+        }
+
+        slabs.back().Right = boundary;
+        slabs.push_back({.Left = boundary});
+    }
+
+    if (stats) {
+        stats->SplitSeconds = GetThreadSeconds() - start;
+        stats->SlabSeconds.assign(slabs.size(), 0);
+    }
+
+    std::vector<TIntersections> results(slabs.size());
+    RunInThreads(slabs.size(), [&] (int i) {
+        auto threadStart = GetThreadSeconds();
+
+        std::vector<TSegment> slabInput;
+        for (const auto& segment : input) {
+            if (slabs[i].Overlaps(segment)) {
+                slabInput.push_back(segment);
+            }
+        }
+        results[i] = SweepLine(slabInput, nullptr, slabs[i]);
+
+        if (stats) {
+            stats->SlabSeconds[i] = GetThreadSeconds() - threadStart;
+        }
+    });
+
+    start = GetThreadSeconds();
+    TIntersections result;
+    for (auto& slabResult : results) {
+        result.merge(slabResult);
+    }
+    if (stats) {
+        stats->MergeSeconds = GetThreadSeconds() - start;
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////
+
+static constexpr char SegmentsMagic[] = "SEGMENTS";
+
+// Binary files hold normalized segments, see WriteSegments. The segments are
+// valid while the file is mapped.
+std::span<const TSegment> MapSegments(const TMappedFile& file)
+{
+    return MapRecords<TSegment>(file, SegmentsMagic);
+}
+
+void WriteSegments(const std::string& path, std::span<const TSegment> segments)
+{
+    std::vector<TSegment> normalized(segments.begin(), segments.end());
+    for (auto& segment : normalized) {
+        segment.Normalize();
+    }
+
+    WriteRecords<TSegment>(path, normalized, SegmentsMagic);
+}
+
+// Four numbers per segment: begin x, begin y, end x, end y.
+std::vector<TSegment> ParseSegments(std::string_view text)
+{
+    std::vector<TSegment> result;
+    TNumberParser<double> parser(text);
+
+    while (parser.SkipSpaces()) {
+        TSegment segment;
+        segment.Begin.X = parser.Next();
+        segment.Begin.Y = parser.Next();
+        segment.End.X = parser.Next();
+        segment.End.Y = parser.Next();
+        segment.Normalize();
+        result.push_back(segment);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////
+
+void Normalize(TTest& testCase)
+{
+    for (auto& segment : testCase.Input) {
+        segment.Normalize();
+    }
+
+    for (auto& [point, segments] : testCase.Expected) {
+        std::set<TSegment> normalized;
+        for (auto segment : segments) {
+            segment.Normalize();
+            normalized.insert(segment);
+        }
+        normalized.swap(segments);
+    }
+}
+
+void Normalize(std::vector<TTest>& testCases)
+{
+    for (auto& testCase : testCases) {
+        Normalize(testCase);
+    }
+}
+
+double RandomInRange(int min, int max)
+{
+    int total = std::abs(min) + max;
+    return rand() % total - std::abs(min);
+}
+
+TPoint RandomPoint(int min, int max)
+{
+    return {.X = RandomInRange(min, max), .Y = RandomInRange(min, max)};
+}
+
+bool CheckCount(const TTest& testCase, const TIntersectionsCount& count)
+{
+    int64_t incidences = 0;
+    for (const auto& [point, segments] : testCase.Expected) {
+        incidences += std::ssize(segments);
+    }
+
+    if (count.Points != std::ssize(testCase.Expected) || count.Incidences != incidences) {
+        std::cout << "Intersections count does not match! Expected points: " << testCase.Expected.size()
+            << " incidences: " << incidences
+            << " actual points: " << count.Points
+            << " incidences: " << count.Incidences
+            << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool CheckAnyIntersection(const TTest& testCase, std::optional<std::pair<int, int>> witness)
+{
+    if (witness.has_value() == testCase.Expected.empty()) {
+        std::cout << "Any intersection check does not match! Expected: " << !testCase.Expected.empty() << std::endl;
+        return false;
+    }
+
+    if (witness && !GetExactIntersection(testCase.Input[witness->first], testCase.Input[witness->second])) {
+        std::cout << "Witness segments do not intersect! Segments: " << testCase.Input[witness->first]
+            << " " << testCase.Input[witness->second] << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Collinear segments never intersect by definition, but the third segment
+// through their common point is reported with both of them by BruteForce.
+bool HasCollinear(const std::vector<TSegment>& input, const TSegment& segment)
+{
+    auto begin = ToIntegerPoint(segment.Begin);
+    auto end = ToIntegerPoint(segment.End);
+
+    return std::any_of(input.begin(), input.end(), [&] (const TSegment& other) {
+        return Orientation(begin, end, ToIntegerPoint(other.Begin)) == 0
+            && Orientation(begin, end, ToIntegerPoint(other.End)) == 0;
+    });
+}
+
+std::vector<TSegment> RandomSegments(int count, int minValue, int maxValue)
+{
+    std::vector<TSegment> result;
+
+    while (std::ssize(result) < count) {
+        TSegment segment {
+            .Begin = RandomPoint(minValue, maxValue),
+            .End = RandomPoint(minValue, maxValue),
+        };
+
+        segment.Normalize();
+        if (segment.Begin == segment.End || HasCollinear(result, segment)) {
+            continue;
+        }
+
+        result.push_back(segment);
+    }
+
+    return result;
+}
+
+int ParallelStressTest()
+{
+    static const int SegmentsCount = 30;
+    static const int TestsCount = 1000;
+    static const int ThreadsCount = 4;
+
+    for (int i = 0; i < TestsCount; ++i) {
+        TTest testCase {
+            .Input = RandomSegments(SegmentsCount, -20, 20),
+        };
+        testCase.Expected = BruteForce(testCase.Input);
+
+        if (!CheckTestCase(testCase, SweepLineParallel(testCase.Input, ThreadsCount))
+            || !CheckTestCase(testCase, SweepLineParallel(testCase.Input, 2 * ThreadsCount))
+            || !CheckTestCase(testCase, GridIntersections(testCase.Input)))
+        {
+            std::cout << "Input: " << testCase.Input << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+// Endpoint events made by several threads and sorted by radix sort must be
+// ordered by points and hold both endpoints of every segment.
+int EventQueueStressTest()
+{
+    static const int ThreadsCount = 3;
+
+    auto isLess = [] (const TEndpoint& left, const TEndpoint& right) {
+        return std::tie(left.Key, left.Segment, left.IsEnd) < std::tie(right.Key, right.Segment, right.IsEnd);
+    };
+
+    for (int segmentsCount : {10, 5000, 300000}) {
+        auto input = RandomSegments(segmentsCount, -MaxCoordinate, MaxCoordinate);
+
+        std::vector<TEndpoint> expected;
+        for (uint32_t i = 0; i < input.size(); ++i) {
+            expected.push_back({.Key = TEndpoint::MakeKey(ToIntegerPoint(input[i].Begin)), .Segment = i, .IsEnd = false});
+            expected.push_back({.Key = TEndpoint::MakeKey(ToIntegerPoint(input[i].End)), .Segment = i, .IsEnd = true});
+        }
+        std::sort(expected.begin(), expected.end(), isLess);
+
+        for (int threadsCount : {1, ThreadsCount}) {
+            auto queue = MakeEventQueue(input, std::pmr::get_default_resource(), threadsCount);
+            std::vector<TEndpoint> endpoints(queue.Endpoints.begin(), queue.Endpoints.end());
+
+            auto isOrdered = std::is_sorted(endpoints.begin(), endpoints.end(), [] (const TEndpoint& left, const TEndpoint& right) {
+                return left.GetPoint() < right.GetPoint();
+            });
+            std::sort(endpoints.begin(), endpoints.end(), isLess);
+
+            auto isSame = std::equal(expected.begin(), expected.end(), endpoints.begin(), endpoints.end(),
+                [] (const TEndpoint& left, const TEndpoint& right) {
+                    return left.Key == right.Key && left.Segment == right.Segment && left.IsEnd == right.IsEnd;
+                });
+
+            if (!isOrdered || !isSame) {
+                std::cout << "Event queue does not match! Segments: " << segmentsCount
+                    << ", threads: " << threadsCount << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+// Edges of a triangulated square lattice shifted by the offset: a crossing-free
+// network where every vertex is shared by six edges.
+std::vector<TSegment> LatticeNetwork(int cellsCount, int step, TPoint offset)
+{
+    std::vector<TSegment> result;
+    for (int i = 0; i < cellsCount; ++i) {
+        for (int j = 0; j < cellsCount; ++j) {
+            TPoint corner {.X = i * step + offset.X, .Y = j * step + offset.Y};
+            result.push_back({.Begin = corner, .End = {corner.X + step, corner.Y}});
+            result.push_back({.Begin = corner, .End = {corner.X, corner.Y + step}});
+            result.push_back({.Begin = corner, .End = {corner.X + step, corner.Y + step}});
+        }
+    }
+    return result;
+}
+
+// Segments of the layer meet only at common endpoints, no segment is collinear
+// with another one of either layer. Endpoints are taken from a small square, so
+// many segments share them.
+std::vector<TSegment> RandomCrossingFreeLayer(int count, int minValue, int maxValue, const std::vector<TSegment>& other)
+{
+    static const int MaxAttempts = 1000;
+
+    auto meetsAtEndpoints = [] (const TSegment& first, const TSegment& second) {
+        auto point = GetIntersection(first, second);
+        return !point
+            || ((*point == first.Begin || *point == first.End) && (*point == second.Begin || *point == second.End));
+    };
+
+    std::vector<TSegment> result;
+    for (int attempt = 0; attempt < MaxAttempts && std::ssize(result) < count; ++attempt) {
+        TSegment segment {
+            .Begin = RandomPoint(minValue, maxValue),
+            .End = RandomPoint(minValue, maxValue),
+        };
+
+        segment.Normalize();
+        if (segment.Begin == segment.End || HasCollinear(result, segment) || HasCollinear(other, segment)) {
+            continue;
+        }
+        if (!std::all_of(result.begin(), result.end(), [&] (const TSegment& existing) { return meetsAtEndpoints(segment, existing); })) {
+            continue;
+        }
+
+        result.push_back(segment);
+    }
+
+    return result;
+}
+
+int RedBlueStressTest()
+{
+    static const int SegmentsCount = 30;
+    static const int TestsCount = 10000;
+
+    for (int i = 0; i < TestsCount; ++i) {
+        auto input = RandomSegments(SegmentsCount, -20, 20);
+        std::vector<TSegment> red(input.begin(), input.begin() + SegmentsCount / 2);
+        std::vector<TSegment> blue(input.begin() + SegmentsCount / 2, input.end());
+
+        TTest testCase {
+            .Input = input,
+            .Expected = RedBlueBruteForce(red, blue),
+        };
+
+        if (!CheckTestCase(testCase, RedBlueSweepLine(red, blue))) {
+            std::cout << "Red: " << red << std::endl;
+            std::cout << "Blue: " << blue << std::endl;
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < TestsCount; ++i) {
+        auto red = RandomCrossingFreeLayer(SegmentsCount / 2, -8, 8, {});
+        auto blue = RandomCrossingFreeLayer(SegmentsCount / 2, -8, 8, red);
+
+        TTest testCase {
+            .Input = red,
+            .Expected = RedBlueBruteForce(red, blue),
+        };
+        testCase.Input.insert(testCase.Input.end(), blue.begin(), blue.end());
+
+        if (!CheckTestCase(testCase, RedBlueSweepLine(red, blue, ELayers::CrossingFree))
+            || !CheckTestCase(testCase, RedBlueSweepLine(red, blue, ELayers::MayCross)))
+        {
+            std::cout << "Crossing-free red: " << red << std::endl;
+            std::cout << "Crossing-free blue: " << blue << std::endl;
+            return 1;
+        }
+    }
+
+    // Collinear edges of a layer meet at common vertices.
+    auto red = LatticeNetwork(10, 10, {0, 0});
+    auto blue = LatticeNetwork(10, 10, {3, 7});
+    TTest lattices {
+        .Input = red,
+        .Expected = RedBlueBruteForce(red, blue),
+    };
+    if (!CheckTestCase(lattices, RedBlueSweepLine(red, blue, ELayers::CrossingFree))) {
+        return 1;
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+void LinearScanCrossing(const std::vector<TSegment>& input, const TSegment& query, std::vector<int>& results)
+{
+    for (int i = 0; i < std::ssize(input); ++i) {
+        if (GetIntersection(input[i], query)) {
+            results.push_back(i);
+        }
+    }
+}
+
+void LinearScanWindow(const std::vector<TSegment>& input, const TBox& window, std::vector<int>& results)
+{
+    for (int i = 0; i < std::ssize(input); ++i) {
+        if (Intersects(input[i], window)) {
+            results.push_back(i);
+        }
+    }
+}
+
+TSegmentRTree::TNearest LinearScanNearest(const std::vector<TSegment>& input, const TPoint& point)
+{
+    TSegmentRTree::TNearest result;
+    for (int i = 0; i < std::ssize(input); ++i) {
+        if (auto distance = SquaredDistance(point, input[i]); distance < result.SquaredDistance) {
+            result = {.Segment = i, .SquaredDistance = distance};
+        }
+    }
+    return result;
+}
+
+// Ties may be resolved to different segments, and rounding of the box bound
+// may hide a segment closer by an ulp, so only distances are compared.
+bool IsSameNearest(const TSegmentRTree::TNearest& left, const TSegmentRTree::TNearest& right)
+{
+    if (left.Segment < 0 || right.Segment < 0) {
+        return left.Segment == right.Segment;
+    }
+    return std::abs(left.SquaredDistance - right.SquaredDistance) <= 1e-9 * std::max(1.0, right.SquaredDistance);
+}
+
+// Independent of Intersects: clips the segment parameter range [0, 1] by both
+// slabs of the window (Liang-Barsky) in exact fractions.
+bool ClipsByWindow(const TSegment& segment, const TBox& window)
+{
+    auto begin = ToIntegerPoint(segment.Begin);
+    auto end = ToIntegerPoint(segment.End);
+
+    // Fractions with positive denominators.
+    std::pair<int64_t, int64_t> low {0, 1};
+    std::pair<int64_t, int64_t> high {1, 1};
+    auto isLess = [] (std::pair<int64_t, int64_t> left, std::pair<int64_t, int64_t> right) {
+        return left.first * right.second < right.first * left.second;
+    };
+
+    std::tuple<int64_t, int64_t, int64_t, int64_t> axes[] = {
+        {begin.X, end.X, window.Min.X, window.Max.X},
+        {begin.Y, end.Y, window.Min.Y, window.Max.Y},
+    };
+    for (auto [from, to, min, max] : axes) {
+        auto delta = to - from;
+        if (delta == 0) {
+            if (from < min || from > max) {
+                return false;
+            }
+            continue;
+        }
+
+        std::pair<int64_t, int64_t> enter {min - from, delta};
+        std::pair<int64_t, int64_t> leave {max - from, delta};
+        if (delta < 0) {
+            enter = {from - max, -delta};
+            leave = {from - min, -delta};
+        }
+
+        if (isLess(low, enter)) {
+            low = enter;
+        }
+        if (isLess(leave, high)) {
+            high = leave;
+        }
+    }
+
+    return !isLess(high, low);
+}
+
+TBox RandomBox(int min, int max)
+{
+    auto first = ToIntegerPoint(RandomPoint(min, max));
+    auto second = ToIntegerPoint(RandomPoint(min, max));
+    return {
+        .Min = {.X = std::min(first.X, second.X), .Y = std::min(first.Y, second.Y)},
+        .Max = {.X = std::max(first.X, second.X), .Y = std::max(first.Y, second.Y)},
+    };
+}
+
+int RTreeStressTest()
+{
+    static const int TestsCount = 1000;
+    static const int QueriesCount = 20;
+    static const int BatchedTestsPeriod = 50;
+    static const int BatchSize = 4096;
+    static const int BatchThreadsCount = 3;
+
+    TSegment diagonal {.Begin = {-5, -5}, .End = {5, 5}};
+    TSegment horizontal {.Begin = {-5, 0}, .End = {5, 0}};
+    if (!Intersects(diagonal, {.Min = {0, 0}, .Max = {0, 0}})
+        || !Intersects(horizontal, {.Min = {-1, 0}, .Max = {1, 0}})
+        || Intersects(diagonal, {.Min = {1, 0}, .Max = {1, 0}}))
+    {
+        std::cout << "Degenerate windows are not handled!" << std::endl;
+        return 1;
+    }
+
+    for (int i = 0; i < TestsCount; ++i) {
+        auto input = RandomSegments(1 + i % 300, -50, 50);
+
+        // The tree keeps its own segments, so it does not see the input change
+        // or go away after the construction.
+        auto temporary = input;
+        TSegmentRTree tree(temporary);
+        temporary.assign(temporary.size(), TSegment{});
+
+        if (i % BatchedTestsPeriod == 0) {
+            std::vector<TPoint> points;
+            for (int query = 0; query < BatchSize; ++query) {
+                points.push_back(RandomPoint(-60, 60));
+            }
+
+            auto nearest = tree.FindNearest(points, BatchThreadsCount);
+            for (int query = 0; query < BatchSize; ++query) {
+                if (!IsSameNearest(nearest[query], LinearScanNearest(input, points[query]))) {
+                    std::cout << "Batched nearest segment does not match! Input: " << input
+                        << " point: " << points[query] << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        for (int query = 0; query < QueriesCount; ++query) {
+            TSegment segment {.Begin = RandomPoint(-60, 60), .End = RandomPoint(-60, 60)};
+            segment.Normalize();
+
+            // Windows of zero width or height and points are frequent.
+            auto window = RandomBox(-60, 60);
+            if (query % 4 == 1 || query % 4 == 3) {
+                window.Max.X = window.Min.X;
+            }
+            if (query % 4 == 2 || query % 4 == 3) {
+                window.Max.Y = window.Min.Y;
+            }
+
+            std::vector<int> expectedCrossing, crossing, expectedInWindow, inWindow;
+            LinearScanCrossing(input, segment, expectedCrossing);
+            tree.FindCrossing(segment, crossing);
+            for (int index = 0; index < std::ssize(input); ++index) {
+                if (ClipsByWindow(input[index], window)) {
+                    expectedInWindow.push_back(index);
+                }
+            }
+            tree.FindInWindow(window, inWindow);
+
+            std::sort(crossing.begin(), crossing.end());
+            std::sort(inWindow.begin(), inWindow.end());
+
+            // Queries of the nearest segment are not limited to integer points.
+            TPoint point {.X = RandomInRange(-6000, 6000) / 100.0, .Y = RandomInRange(-6000, 6000) / 100.0};
+            auto isSameNearest = IsSameNearest(tree.FindNearest(point), LinearScanNearest(input, point));
+
+            if (crossing != expectedCrossing || inWindow != expectedInWindow || !isSameNearest) {
+                std::cout << "R-tree results do not match! Input: " << input
+                    << " query: " << segment << " nearest to: " << point << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+int IncrementalStressTest()
+{
+    static const int TestsCount = 1000;
+    static const int OperationsCount = 100;
+
+    for (int i = 0; i < TestsCount; ++i) {
+        TIncrementalIntersections intersections(1 + i % 20);
+        std::vector<int> ids;
+
+        for (int operation = 0; operation < OperationsCount; ++operation) {
+            if (!ids.empty() && rand() % 3 == 0) {
+                auto position = rand() % ids.size();
+                intersections.Remove(ids[position]);
+                ids[position] = ids.back();
+                ids.pop_back();
+            } else {
+                TSegment segment {.Begin = RandomPoint(-20, 20), .End = RandomPoint(-20, 20)};
+                segment.Normalize();
+                if (segment.Begin == segment.End || HasCollinear(intersections.GetSegments(), segment)) {
+                    continue;
+                }
+
+                // A segment visits at most two cells per row and column it spans.
+                auto box = TBox::FromSegment(segment);
+                int64_t cellsCount = 0;
+                intersections.ForEachCell(segment, [&] (int64_t) { ++cellsCount; });
+                auto columnsCount = (box.Max.X + MaxCoordinate) / intersections.CellSide - (box.Min.X + MaxCoordinate) / intersections.CellSide + 1;
+                auto rowsCount = (box.Max.Y + MaxCoordinate) / intersections.CellSide - (box.Min.Y + MaxCoordinate) / intersections.CellSide + 1;
+                if (cellsCount > 2 * (columnsCount + rowsCount)) {
+                    std::cout << "Segment visits too many cells: " << cellsCount << ", segment: " << segment << std::endl;
+                    return 1;
+                }
+
+                std::vector<TIncrementalIntersections::TCrossing> crossings;
+                ids.push_back(intersections.Insert(segment, &crossings));
+                for (const auto& crossing : crossings) {
+                    if (GetIntersection(segment, intersections.Segments[crossing.Segment]) != crossing.Point) {
+                        std::cout << "Reported crossing is wrong! Segment: " << segment << std::endl;
+                        return 1;
+                    }
+                }
+            }
+
+            TTest testCase {.Input = intersections.GetSegments()};
+            testCase.Expected = SweepLine(testCase.Input);
+            if (!CheckTestCase(testCase, intersections.GetIntersections())) {
+                std::cout << "Input: " << testCase.Input << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+// Star shaped ring around the center: mostly simple, but rounding of vertices
+// makes some rings touch themselves.
+std::vector<TPoint> RandomStarRing(int verticesCount, TPoint center, int radius)
+{
+    std::vector<TPoint> result;
+    result.reserve(verticesCount);
+
+    for (int i = 0; i < verticesCount; ++i) {
+        auto angle = 2 * M_PI * (i + RandomInRange(0, 900) / 1000.0) / verticesCount;
+        auto distance = radius - RandomInRange(0, radius / 2);
+        result.push_back({
+            .X = std::round(center.X + distance * std::cos(angle)),
+            .Y = std::round(center.Y + distance * std::sin(angle)),
+        });
+    }
+
+    return result;
+}
+
+int RingValidatorStressTest()
+{
+    static const int TestsCount = 100000;
+
+    TRingValidator validator;
+    int simpleCount = 0;
+
+    for (int i = 0; i < TestsCount; ++i) {
+        auto verticesCount = 3 + i % 100;
+        auto ring = i % 2 == 0
+            ? RandomStarRing(verticesCount, {}, 2 * verticesCount + i % 50)
+            : std::vector<TPoint>();
+        while (std::ssize(ring) < verticesCount) {
+            ring.push_back(RandomPoint(-30, 30));
+        }
+
+        simpleCount += validator.Validate(ring) == ERingStatus::Simple;
+
+        if (validator.PrepareEdges(ring) != ERingStatus::Simple) {
+            continue;
+        }
+
+        if (validator.HasCrossingBruteForce() != validator.HasCrossingSweep()) {
+            std::cout << "Ring validation does not match! Edges: " << validator.Edges << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "OK, simple rings: " << simpleCount << std::endl;
+    return 0;
+}
+
+// Short segments, so that a good part of the cases has no intersections.
+int AnyIntersectionStressTest()
+{
+    static const int SegmentsCount = 20;
+    static const int TestsCount = 100000;
+    static const int MaxValue = 20;
+    static const int MaxLength = 4;
+
+    int withoutIntersections = 0;
+    for (int i = 0; i < TestsCount; ++i) {
+        TTest testCase;
+
+        while (std::ssize(testCase.Input) < SegmentsCount) {
+            auto begin = RandomPoint(-MaxValue, MaxValue);
+            auto end = RandomPoint(-MaxLength, MaxLength);
+            TSegment segment {
+                .Begin = begin,
+                .End = {.X = begin.X + end.X, .Y = begin.Y + end.Y},
+            };
+
+            segment.Normalize();
+            if (segment.Begin == segment.End || HasCollinear(testCase.Input, segment)) {
+                continue;
+            }
+
+            testCase.Input.push_back(segment);
+        }
+
+        testCase.Expected = BruteForce(testCase.Input);
+        withoutIntersections += testCase.Expected.empty();
+
+        if (!CheckAnyIntersection(testCase, FindAnyIntersection(testCase.Input))) {
+            std::cout << "Input: " << testCase.Input << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "OK, cases without intersections: " << withoutIntersections << std::endl;
+    return 0;
+}
+
+int StressTest()
+{
+    static const int SegmentsCount = 3;
+    static const int TestsCount = 1000000;
+
+    int minValue = -10;
+    int maxValue = 10;
+
+    for (int i = 0; i < TestsCount; ++i) {
+        TTest testCase;
+
+        for (int segmentIndex = 0; segmentIndex < SegmentsCount; ++segmentIndex) {
+            TSegment segment {
+                .Begin = RandomPoint(minValue, maxValue),
+                .End = RandomPoint(minValue, maxValue),
+            };
+
+            segment.Normalize();
+            if (segment.Begin == segment.End) {
+                continue;
+            }
+
+            if (HasCollinear(testCase.Input, segment)) {
+                continue;
+            }
+
+            testCase.Input.push_back(std::move(segment));
+            testCase.Expected = BruteForce(testCase.Input);
+            if (!CheckTestCase(testCase, SweepLine(testCase.Input))
+                || !CheckTestCase(testCase, GridIntersections(testCase.Input))
+                || !CheckCount(testCase, CountIntersections(testCase.Input))
+                || !CheckAnyIntersection(testCase, FindAnyIntersection(testCase.Input)))
+            {
+                std::cout << "Input: " << testCase.Input << std::endl;
+
+                for (const auto& [point, segments] : testCase.Expected) {
+                    std::cout << "Intersection : " << point  << " segments: " << segments << std::endl;
+                }
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+// Concurrent writers leave the last Capacity records in order, none of them torn.
+// A writer preempted for the whole lap of the ring may drop its record. Dumps
+// taken while the writers are running skip the slots being written.
+bool TraceRingTest()
+{
+    static const int ThreadsCount = 4;
+    static const int64_t RecordsPerThread = TTraceRing<ETraceEvent>::Capacity / 2;
+
+    TTraceRing<ETraceEvent> ring;
+    std::atomic<int> runningCount = ThreadsCount;
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < ThreadsCount; ++thread) {
+        threads.emplace_back([&ring, &runningCount, thread] {
+            for (int64_t i = 0; i < RecordsPerThread; ++i) {
+                ring.Push(ETraceEvent::AddSegment, thread, i, 2 * i, 3 * i);
+            }
+            --runningCount;
+        });
+    }
+
+    // Number of dumped records, or -1 if some record is torn or out of order.
+    auto checkDump = [&ring] (uint64_t minIndex) -> int64_t {
+        std::stringstream dump;
+        ring.Dump(dump);
+
+        int64_t recordsCount = 0;
+        std::string line;
+        while (std::getline(dump, line)) {
+            std::stringstream fields(line);
+            uint64_t index;
+            std::string event;
+            int64_t thread, i, doubled, tripled;
+            fields >> index >> event >> thread >> i >> doubled >> tripled;
+
+            if (index < minIndex || event != "AddSegment" || doubled != 2 * i || tripled != 3 * i) {
+                return -1;
+            }
+            minIndex = index + 1;
+            ++recordsCount;
+        }
+        return recordsCount;
+    };
+
+    bool isTorn = false;
+    while (runningCount > 0) {
+        isTorn |= checkDump(0) < 0;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto recordsCount = checkDump(ring.GetCount() - TTraceRing<ETraceEvent>::Capacity);
+    return !isTorn && recordsCount >= static_cast<int64_t>(TTraceRing<ETraceEvent>::Capacity) - ThreadsCount;
+}
+
+int test()
+{
+    std::vector<TTest> tests = {
+        // {
+        //     .Input = {{{1,1}, {4, 4}}, {{8, 1}, {4, 2}}},
+        //     .Expected = {},
+        // },
+        // {
+        //     .Input = { {{1,1}, {4, 4}}, {{8, 1}, {0, 3}} },
+        //     .Expected = { {{RoundToPrecision(2.4), RoundToPrecision(2.4)}, {{{1,1}, {4, 4}}, {{8, 1}, {0, 3}}, }}},
+        // },
+        // {
+        //     .Input = {{{3,1}, {7, 5}}, {{5, 5}, {5, 0}}},
+        //     .Expected = { {{RoundToPrecision(5), RoundToPrecision(3)}, {{{{3,1}, {7, 5}}, {{5, 5}, {5, 0}}} }}},
+        // },
+        // {
+        //     .Input = {{{4,0}, {4, 4}}, {{0, 2}, {8, 2}}, {{0, -6}, {5, 4}}},
+        //     .Expected = { {{RoundToPrecision(4), RoundToPrecision(2)}, {{{{0, -6}, {5, 4}}, {{4,0}, {4, 4}}, {{0, 2}, {8, 2}}} }}},
+        // },
+        // {
+        //     .Input = {{{3, -4}, {5, 0}}, {{1, -10}, {6, 3}}, {{-8, 0}, {6, -9}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(2.29956), RoundToPrecision(-6.62115)}, {{{{-8, 0}, {6, -9}}, {{1, -10}, {6, 3}}, } }},
+        //         {{RoundToPrecision(4.33333), RoundToPrecision(-1.33333)}, {{{{1, -10}, {6, 3}}, {{3, -4}, {5, 0}}, } }}
+        //     },
+        // },
+        // {
+        //     .Input = {{{3, -4}, {5, 0}}, {{1, -10}, {6, 3}}, {{-8, 0}, {6, -9}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(2.29956), RoundToPrecision(-6.62115)}, {{{{-8, 0}, {6, -9}}, {{1, -10}, {6, 3}}, } }},
+        //         {{RoundToPrecision(4.33333), RoundToPrecision(-1.33333)}, {{{{1, -10}, {6, 3}}, {{3, -4}, {5, 0}}, } }}
+        //     },
+        // },
+        // {
+        //     .Input = {{{3, 4}, {7, 0}}, {{-7, 4}, {4, 3}}, },
+        //     .Expected = {
+        //         {{RoundToPrecision(4), RoundToPrecision(3)}, {{{{3, 4}, {7, 0}}, {{-7, 4}, {4, 3}}, } }},
+        //     },
+        // },
+        // {
+        //     .Input = {{{-4, 0}, {-1, 9}}, {{-1, 9}, {6, -6}},},
+        //     .Expected = {
+        //         {{RoundToPrecision(-1), RoundToPrecision(9)}, {{ {{-4, 0}, {-1, 9}}, {{-1, 9}, {6, -6}}, } }},
+        //     },
+        // },
+        // {
+        //     .Input = {{{-9 , -7}, {-1 , 7}}, {{-10 , -4}, {1 , 2}}, {{-6 , -1}, {8 , -3}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(-6.0566), RoundToPrecision(-1.84906)}, {{ {{-10 , -4}, {1 , 2}}, {{-9 , -7}, {-1 , 7}}, } }},
+        //         {{RoundToPrecision(-5.60377), RoundToPrecision(-1.0566)}, {{ {{-9 , -7}, {-1 , 7}}, {{-6 , -1}, {8 , -3}}, } }},
+        //         {{RoundToPrecision(-4.81132), RoundToPrecision(-1.16981)}, {{ {{-10 , -4}, {1 , 2}}, {{-6 , -1}, {8 , -3}}, } }},
+        //     },
+        // },
+        // {
+        //     .Input = {{{-8 , 5}, {3 , -2}}, {{-5 , -4}, {5 , 0}}, {{-7 , -6}, {-4 , -3}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(-5), RoundToPrecision(-4)}, {{ {{-5 , -4}, {5 , 0}}, {{-7 , -6}, {-4 , -3}}, } }},
+        //         {{RoundToPrecision(1.84211), RoundToPrecision(-1.26316)}, {{ {{-8 , 5}, {3 , -2}}, {{-5 , -4}, {5 , 0}}, } }}
+        //     },
+        // },
+        // {
+        //     .Input = {{{-10 , -3}, {5 , -10}}, {{-3 , -9}, {0 , 6}}, {{-10 , -3}, {0 , 5}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(-10), RoundToPrecision(-3)}, {{ {{-10 , -3}, {5 , -10}}, {{-10 , -3}, {0 , 5}}, } }},
+        //         {{RoundToPrecision(-2.5), RoundToPrecision(-6.5)}, {{ {{-10 , -3}, {5 , -10}}, {{-3 , -9}, {0 , 6}}, } }},
+        //         {{RoundToPrecision(-0.2381), RoundToPrecision(4.80952)}, {{ {{-10 , -3}, {0 , 5}}, {{-3 , -9}, {0 , 6}}, } }}
+        //     },
+        // },
+        // {
+        //     .Input = {{{3, -10}, {4, 3}}, {{-5 , -8}, {8 , 0}}, {{-2 , -10}, {8 , -8}}},
+        //     .Expected = {
+        //         {{RoundToPrecision(3.55901), RoundToPrecision(-2.73292)}, {{ {{-5 , -8}, {8 , 0}}, {{3 , -10}, {4 , 3}}, } }},
+        //         {{RoundToPrecision(3.07813), RoundToPrecision(-8.98438)}, {{ {{-2 , -10}, {8 , -8}}, {{3 , -10}, {4 , 3}}, } }},
+        //     },
+        // },
+        {
+            .Input = {{{-1, 0}, {1, 2}}, {{-10 , -2}, {-6 , -8}}, {{-7 , -9}, {3 , 8}}},
+            .Expected = {
+                {{-6.21875, -7.671875}, {{ {{-10 , -2}, {-6 , -8}}, {{-7 , -9}, {3 , 8}} } }},
+            },
+        },
+    };
+
+    Normalize(tests);
+
+    // const auto& test = tests.front();
+
+    // auto s1 = test.Input[0];
+    // auto s2 = test.Input[2];
+
+    // auto pointX = RoundToPrecision(-10);
+    // TTrackingSegment ts1(&s1, pointX);
+    // TTrackingSegment ts2(&s2, pointX);
+
+    // bool result = ts1 < ts2;
+    // std::cout << result << std::endl;
+
+    // std::cout << "ts1: " << *ts1.Parameters.GetAtX(pointX) << std::endl; 
+    // std::cout << "ts2: " << *ts2.Parameters.GetAtX(pointX) << std::endl;
+
+    if (!TraceRingTest()) {
+        std::cout << "Trace ring lost or tore records!" << std::endl;
+        return 1;
+    }
+
+    {
+        auto path = (std::filesystem::temp_directory_path() / "segments_loader_test.bin").string();
+        WriteSegments(path, tests[0].Input);
+        TMappedFile file(path);
+        auto mapped = MapSegments(file);
+        auto parsed = ParseSegments("-10 -10 10 10\n10.0 -10\t-10 10\n");
+        std::filesystem::remove(path);
+
+        if (!std::equal(mapped.begin(), mapped.end(), tests[0].Input.begin(), tests[0].Input.end())
+            || parsed != std::vector<TSegment>{{{-10, -10}, {10, 10}}, {{-10, 10}, {10, -10}}})
+        {
+            std::cout << "Loaded segments do not match!" << std::endl;
+            return 1;
+        }
+
+        for (auto text : {"0 0 0.5 1\n", "0 0 5000000 1\n", "-4194305 0 0 0\n"}) {
+            try {
+                VerifySupported(ParseSegments(text));
+                std::cout << "Unsupported segment is accepted: " << text << std::endl;
+                return 1;
+            } catch (const std::runtime_error&) {
+            }
+        }
+        VerifySupported(ParseSegments("-4194304 0 4194304 -4194304\n"));
+    }
+
+    std::vector<std::pair<std::vector<TPoint>, ERingStatus>> rings {
+        {{{0, 0}, {4, 0}, {4, 4}, {0, 4}}, ERingStatus::Simple},
+        {{{0, 0}, {4, 0}, {4, 4}, {0, 4}, {0, 0}}, ERingStatus::Simple},
+        {{{0, 0}, {4, 0}, {0, 4}, {4, 4}}, ERingStatus::SelfIntersection},
+        {{{0, 0}, {4, 0}, {2, 0}, {2, 4}}, ERingStatus::SelfIntersection},
+        {{{0, 0}, {2, 2}, {4, 0}, {4, 4}, {2, 2}, {0, 4}}, ERingStatus::SelfIntersection},
+        {{{0, 0}, {2, 0}, {4, 0}, {4, 4}}, ERingStatus::Simple},
+        {{{0, 0}, {4, 0}, {4, 0}, {4, 4}}, ERingStatus::RepeatedVertex},
+        {{{0, 0}, {4, 0}, {0, 0}}, ERingStatus::TooFewVertices},
+    };
+
+    TRingValidator validator;
+    for (const auto& [ring, expected] : rings) {
+        if (validator.Validate(ring) != expected) {
+            std::cout << "Ring status does not match! Ring vertices: " << ring.size()
+                << " expected: " << static_cast<int>(expected) << std::endl;
+            return 1;
+        }
+    }
+
+    for (const auto& test : tests) {
+        if (!CheckTestCase(test, BruteForce(test.Input))) {
+            return 1;
+        }
+
+        if (!CheckTestCase(test, SweepLine(test.Input))) {
+            return 1;
+        }
+
+        if (!CheckTestCase(test, GridIntersections(test.Input))) {
+            return 1;
+        }
+
+        if (!CheckCount(test, CountIntersections(test.Input))) {
+            return 1;
+        }
+
+        if (!CheckAnyIntersection(test, FindAnyIntersection(test.Input))) {
+            return 1;
         }
     }
 
@@ -514,116 +3293,981 @@ int StressTest()
     return 0;
 }
 
-int test()
+double RandomInRange(std::mt19937_64& random, int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(random);
+}
+
+TPoint RandomPoint(std::mt19937_64& random, int min, int max)
+{
+    return {.X = RandomInRange(random, min, max), .Y = RandomInRange(random, min, max)};
+}
+
+TTest GenerateFuzzCase(std::mt19937_64& random)
+{
+    auto maxValue = RandomInRange(random, 1, 20);
+    auto segmentsCount = RandomInRange(random, 1, 30);
+    TTest testCase;
+
+    for (int i = 0; i < segmentsCount; ++i) {
+        TSegment segment {
+            .Begin = RandomPoint(random, -maxValue, maxValue),
+            .End = RandomPoint(random, -maxValue, maxValue),
+        };
+
+        segment.Normalize();
+        if (segment.Begin != segment.End && !HasCollinear(testCase.Input, segment)) {
+            testCase.Input.push_back(segment);
+        }
+    }
+
+    return testCase;
+}
+
+bool IsCorrect(const TTest& testCase)
+{
+    auto expected = BruteForce(testCase.Input);
+
+    return SweepLine(testCase.Input) == expected
+        && SweepLineParallel(testCase.Input, 4) == expected
+        && GridIntersections(testCase.Input) == expected
+        && CountIntersections(testCase.Input).Points == std::ssize(expected)
+        && FindAnyIntersection(testCase.Input).has_value() == !expected.empty();
+}
+
+void PrintFuzzCase(const TTest& testCase)
+{
+    std::cout << "Input: " << testCase.Input << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////
+
+std::vector<TSegment> RandomShortSegments(int count, int maxValue, int maxLength)
+{
+    std::vector<TSegment> result;
+    result.reserve(count);
+
+    while (std::ssize(result) < count) {
+        TSegment segment;
+        segment.Begin = RandomPoint(0, maxValue);
+        segment.End = {
+            .X = segment.Begin.X + RandomInRange(-maxLength, maxLength),
+            .Y = segment.Begin.Y + RandomInRange(-maxLength, maxLength),
+        };
+
+        if (segment.Begin.X == segment.End.X) {
+            continue;
+        }
+
+        segment.Normalize();
+        result.push_back(segment);
+    }
+
+    return result;
+}
+
+// Long parallel segments: no intersections, but the sweep line holds most of them.
+std::vector<TSegment> ParallelSegments(int count, int maxValue)
+{
+    std::vector<TSegment> result;
+    result.reserve(count);
+
+    for (int i = 0; i < count; ++i) {
+        auto x = RandomInRange(0, maxValue);
+        result.push_back({.Begin = {.X = x, .Y = 2.0 * i}, .End = {.X = x + maxValue, .Y = 2.0 * i + 1}});
+        result.back().Normalize();
+    }
+
+    return result;
+}
+
+// Counts heap allocations of the whole program, to see how many of them the
+// benchmarked code makes. Compiled in with -DCOUNT_ALLOCATIONS=1 only: every
+// allocation of every thread touches the shared counter, which would bring
+// back the contention of threads in the allocator.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+
+#if COUNT_ALLOCATIONS
+std::atomic<int64_t> AllocationsCount = 0;
+
+void* operator new(size_t size)
+{
+    AllocationsCount.fetch_add(1, std::memory_order_relaxed);
+    if (auto* result = std::malloc(size == 0 ? 1 : size)) {
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+// Memory resources allocate with alignment.
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    AllocationsCount.fetch_add(1, std::memory_order_relaxed);
+    auto align = static_cast<size_t>(alignment);
+    if (auto* result = std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align)) {
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+// Not inlined, otherwise GCC pairs the inlined free with the new expression and warns.
+__attribute__((noinline)) void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, size_t, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+#endif
+
+template <class TFunction>
+void BenchmarkAllocations(const std::string& name, TFunction&& function)
+{
+#if COUNT_ALLOCATIONS
+    auto allocations = AllocationsCount.load();
+#endif
+    auto start = std::chrono::steady_clock::now();
+    auto result = function();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", result: " << result
+        << ", time: " << elapsed << " s";
+#if COUNT_ALLOCATIONS
+    std::cout << ", allocations: " << AllocationsCount.load() - allocations;
+#else
+    std::cout << ", allocations: not counted, build with -DCOUNT_ALLOCATIONS=1";
+#endif
+    std::cout << std::endl;
+}
+
+long PeakMemoryKiB()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void BenchmarkSweepLine(const std::string& name, const std::vector<TSegment>& input)
+{
+    TSweepStats stats;
+    auto start = std::chrono::steady_clock::now();
+    auto result = SweepLine(input, &stats);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size()
+        << ", intersection points: " << result.size()
+        << ", time: " << elapsed << " s"
+        << " (event queue setup: " << stats.SetupSeconds << " s, sweep: " << stats.SweepSeconds << " s)"
+        << ", throughput: " << input.size() / elapsed << " segments/s"
+        << ", events: " << stats.Events << " (" << stats.Events / elapsed << " events/s)"
+        << ", process peak memory: " << PeakMemoryKiB() / 1024 << " MiB"
+        << std::endl;
+}
+
+// Event queue setup: endpoints with exact points sorted by comparisons, as the
+// sweep did before, against keys sorted by radix sort in several threads.
+void BenchmarkSetup(const std::string& name, const std::vector<TSegment>& input)
+{
+    struct TExactEndpoint
+    {
+        TExactPoint Point;
+        const TSegment* Segment = nullptr;
+        bool IsEnd = false;
+    };
+
+    auto measure = [] (auto&& function) {
+        auto start = std::chrono::steady_clock::now();
+        auto size = function();
+        return std::pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), size);
+    };
+
+    auto [exact, exactCount] = measure([&] {
+        std::vector<TExactEndpoint> endpoints;
+        endpoints.reserve(2 * input.size());
+        for (const auto& segment : input) {
+            endpoints.push_back({.Point = TExactPoint::FromPoint(segment.Begin), .Segment = &segment, .IsEnd = false});
+            endpoints.push_back({.Point = TExactPoint::FromPoint(segment.End), .Segment = &segment, .IsEnd = true});
+        }
+        std::sort(endpoints.begin(), endpoints.end(), [] (const TExactEndpoint& left, const TExactEndpoint& right) {
+            return left.Point < right.Point;
+        });
+        return endpoints.size();
+    });
+
+    std::cout << name << ", segments: " << input.size()
+        << ", event queue setup, exact points and comparison sort: " << exact << " s";
+
+    for (int threadsCount : {1, 2, 4, static_cast<int>(std::thread::hardware_concurrency())}) {
+        auto [radix, radixCount] = measure([&] {
+            return MakeEventQueue(input, std::pmr::get_default_resource(), threadsCount).Endpoints.size();
+        });
+        Verify(radixCount == exactCount);
+        std::cout << ", keys and radix sort in " << threadsCount << " threads: " << radix << " s";
+    }
+    std::cout << std::endl;
+}
+
+// Counting runs first, because peak memory of the process only grows.
+void BenchmarkOutput(const std::string& name, const std::vector<TSegment>& input)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto count = CountIntersections(input);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size()
+        << ", counting only, intersection points: " << count.Points
+        << ", time: " << elapsed << " s"
+        << ", process peak memory: " << PeakMemoryKiB() / 1024 << " MiB"
+        << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    auto result = SweepLine(input);
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size()
+        << ", map of segments, intersection points: " << result.size()
+        << ", time: " << elapsed << " s"
+        << ", process peak memory: " << PeakMemoryKiB() / 1024 << " MiB"
+        << std::endl;
+}
+
+void BenchmarkAnyIntersection(const std::string& name, const std::vector<TSegment>& input)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto witness = FindAnyIntersection(input);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto count = CountIntersections(input);
+    auto fullSweep = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size()
+        << ", any intersection: " << witness.has_value()
+        << ", time: " << elapsed << " s"
+        << ", full sweep: " << fullSweep << " s (" << count.Points << " intersection points)"
+        << std::endl;
+}
+
+// Both layers cross themselves a lot, only a small part of intersections is bichromatic.
+void BenchmarkRedBlue(const std::vector<TSegment>& red, const std::vector<TSegment>& blue)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TSegment> input(red);
+    input.insert(input.end(), blue.begin(), blue.end());
+    auto all = SweepLine(input);
+    auto filtered = std::erase_if(all, [&] (const auto& item) {
+        const auto& [point, segments] = item;
+        bool hasRed = false;
+        bool hasBlue = false;
+        for (const auto& segment : segments) {
+            bool isRed = std::binary_search(red.begin(), red.end(), segment);
+            hasRed |= isRed;
+            hasBlue |= !isRed;
+        }
+        return !hasRed || !hasBlue;
+    });
+    auto unionTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto result = RedBlueSweepLine(red, blue);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "red-blue, segments: " << red.size() << " + " << blue.size()
+        << ", bichromatic points: " << result.size()
+        << ", monochromatic points: " << filtered
+        << ", time: " << elapsed << " s"
+        << ", union sweep and filter: " << unionTime << " s"
+        << std::endl;
+}
+
+// Drops segments until no two of the rest meet, so the layer is crossing-free.
+std::vector<TSegment> RemoveCrossings(const std::vector<TSegment>& input)
+{
+    std::vector<bool> isRemoved(input.size());
+    ReportIntersections(input, [&] (const TExactPoint&, const std::vector<int>& segments) {
+        bool isKept = false;
+        for (auto index : segments) {
+            if (!isRemoved[index] && isKept) {
+                isRemoved[index] = true;
+            }
+            isKept |= !isRemoved[index];
+        }
+    });
+
+    std::vector<TSegment> result;
+    for (int i = 0; i < std::ssize(input); ++i) {
+        if (!isRemoved[i]) {
+            result.push_back(input[i]);
+        }
+    }
+    return result;
+}
+
+void BenchmarkCrossingFreeRedBlue(const std::string& name, const std::vector<TSegment>& red, const std::vector<TSegment>& blue)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto mayCross = RedBlueSweepLine(red, blue, ELayers::MayCross);
+    auto mayCrossTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto crossingFree = RedBlueSweepLine(red, blue, ELayers::CrossingFree);
+    auto crossingFreeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "red-blue, " << name << ", segments: " << red.size() << " + " << blue.size()
+        << ", bichromatic points: " << crossingFree.size()
+        << ", crossing-free layers: " << crossingFreeTime << " s"
+        << ", layers may cross: " << mayCrossTime << " s"
+        << ", speedup: " << mayCrossTime / crossingFreeTime
+        << ", results match: " << (mayCross == crossingFree)
+        << std::endl;
+}
+
+void BenchmarkGrid(const std::string& name, const std::vector<TSegment>& input)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto result = GridIntersections(input);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto expected = SweepLine(input);
+    auto sweep = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size()
+        << ", grid intersection points: " << result.size()
+        << ", time: " << elapsed << " s"
+        << ", sweep line: " << sweep << " s"
+        << ", results match: " << (result == expected)
+        << std::endl;
+}
+
+void BenchmarkRTree(const std::string& name, const std::vector<TSegment>& input, int maxValue, int maxLength)
+{
+    static const int QueriesCount = 200;
+
+    std::vector<TSegment> segments;
+    std::vector<TBox> windows;
+    for (int i = 0; i < QueriesCount; ++i) {
+        TSegment segment;
+        segment.Begin = RandomPoint(0, maxValue);
+        segment.End = {
+            .X = segment.Begin.X + RandomInRange(-maxLength, maxLength),
+            .Y = segment.Begin.Y + RandomInRange(-maxLength, maxLength),
+        };
+        segment.Normalize();
+        segments.push_back(segment);
+
+        auto corner = ToIntegerPoint(RandomPoint(0, maxValue));
+        windows.push_back({.Min = corner, .Max = {.X = corner.X + maxLength, .Y = corner.Y + maxLength}});
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    TSegmentRTree tree(input);
+    auto build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto measure = [&] (auto&& query) {
+        std::vector<int> results;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < QueriesCount; ++i) {
+            query(i, results);
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return std::make_pair(elapsed / QueriesCount * 1e6, results.size());
+    };
+
+    auto [treeSegment, treeSegmentResults] = measure([&] (int i, auto& results) { tree.FindCrossing(segments[i], results); });
+    auto [scanSegment, scanSegmentResults] = measure([&] (int i, auto& results) { LinearScanCrossing(input, segments[i], results); });
+    auto [treeWindow, treeWindowResults] = measure([&] (int i, auto& results) { tree.FindInWindow(windows[i], results); });
+    auto [scanWindow, scanWindowResults] = measure([&] (int i, auto& results) { LinearScanWindow(input, windows[i], results); });
+
+    std::cout << name << ", segments: " << input.size()
+        << ", R-tree build: " << build << " s"
+        << ", segment query: " << treeSegment << " us (linear scan: " << scanSegment << " us)"
+        << ", window query: " << treeWindow << " us (linear scan: " << scanWindow << " us)"
+        << ", same results count: " << (treeSegmentResults == scanSegmentResults && treeWindowResults == scanWindowResults)
+        << std::endl;
+}
+
+// Nearest segment to fixes scattered around the segments, like GPS fixes
+// matched to roads. Linear scan answers only a sample of the queries.
+void BenchmarkNearestSegment(const std::string& name, const std::vector<TSegment>& input, int maxValue)
 {
-    std::vector<TTest> tests = {
-        // {
-        //     .Input = {{{1,1}, {4, 4}}, {{8, 1}, {4, 2}}},
-        //     .Expected = {},
-        // },
-        // {
-        //     .Input = { {{1,1}, {4, 4}}, {{8, 1}, {0, 3}} },
-        //     .Expected = { {{RoundToPrecision(2.4), RoundToPrecision(2.4)}, {{{1,1}, {4, 4}}, {{8, 1}, {0, 3}}, }}},
-        // },
-        // {
-        //     .Input = {{{3,1}, {7, 5}}, {{5, 5}, {5, 0}}},
-        //     .Expected = { {{RoundToPrecision(5), RoundToPrecision(3)}, {{{{3,1}, {7, 5}}, {{5, 5}, {5, 0}}} }}},
-        // },
-        // {
-        //     .Input = {{{4,0}, {4, 4}}, {{0, 2}, {8, 2}}, {{0, -6}, {5, 4}}},
-        //     .Expected = { {{RoundToPrecision(4), RoundToPrecision(2)}, {{{{0, -6}, {5, 4}}, {{4,0}, {4, 4}}, {{0, 2}, {8, 2}}} }}},
-        // },
-        // {
-        //     .Input = {{{3, -4}, {5, 0}}, {{1, -10}, {6, 3}}, {{-8, 0}, {6, -9}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(2.29956), RoundToPrecision(-6.62115)}, {{{{-8, 0}, {6, -9}}, {{1, -10}, {6, 3}}, } }},
-        //         {{RoundToPrecision(4.33333), RoundToPrecision(-1.33333)}, {{{{1, -10}, {6, 3}}, {{3, -4}, {5, 0}}, } }}
-        //     },
-        // },
-        // {
-        //     .Input = {{{3, -4}, {5, 0}}, {{1, -10}, {6, 3}}, {{-8, 0}, {6, -9}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(2.29956), RoundToPrecision(-6.62115)}, {{{{-8, 0}, {6, -9}}, {{1, -10}, {6, 3}}, } }},
-        //         {{RoundToPrecision(4.33333), RoundToPrecision(-1.33333)}, {{{{1, -10}, {6, 3}}, {{3, -4}, {5, 0}}, } }}
-        //     },
-        // },
-        // {
-        //     .Input = {{{3, 4}, {7, 0}}, {{-7, 4}, {4, 3}}, },
-        //     .Expected = {
-        //         {{RoundToPrecision(4), RoundToPrecision(3)}, {{{{3, 4}, {7, 0}}, {{-7, 4}, {4, 3}}, } }},
-        //     },
-        // },
-        // {
-        //     .Input = {{{-4, 0}, {-1, 9}}, {{-1, 9}, {6, -6}},},
-        //     .Expected = {
-        //         {{RoundToPrecision(-1), RoundToPrecision(9)}, {{ {{-4, 0}, {-1, 9}}, {{-1, 9}, {6, -6}}, } }},
-        //     },
-        // },
-        // {
-        //     .Input = {{{-9 , -7}, {-1 , 7}}, {{-10 , -4}, {1 , 2}}, {{-6 , -1}, {8 , -3}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(-6.0566), RoundToPrecision(-1.84906)}, {{ {{-10 , -4}, {1 , 2}}, {{-9 , -7}, {-1 , 7}}, } }},
-        //         {{RoundToPrecision(-5.60377), RoundToPrecision(-1.0566)}, {{ {{-9 , -7}, {-1 , 7}}, {{-6 , -1}, {8 , -3}}, } }},
-        //         {{RoundToPrecision(-4.81132), RoundToPrecision(-1.16981)}, {{ {{-10 , -4}, {1 , 2}}, {{-6 , -1}, {8 , -3}}, } }},
-        //     },
-        // },
-        // {
-        //     .Input = {{{-8 , 5}, {3 , -2}}, {{-5 , -4}, {5 , 0}}, {{-7 , -6}, {-4 , -3}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(-5), RoundToPrecision(-4)}, {{ {{-5 , -4}, {5 , 0}}, {{-7 , -6}, {-4 , -3}}, } }},
-        //         {{RoundToPrecision(1.84211), RoundToPrecision(-1.26316)}, {{ {{-8 , 5}, {3 , -2}}, {{-5 , -4}, {5 , 0}}, } }}
-        //     },
-        // },
-        // {
-        //     .Input = {{{-10 , -3}, {5 , -10}}, {{-3 , -9}, {0 , 6}}, {{-10 , -3}, {0 , 5}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(-10), RoundToPrecision(-3)}, {{ {{-10 , -3}, {5 , -10}}, {{-10 , -3}, {0 , 5}}, } }},
-        //         {{RoundToPrecision(-2.5), RoundToPrecision(-6.5)}, {{ {{-10 , -3}, {5 , -10}}, {{-3 , -9}, {0 , 6}}, } }},
-        //         {{RoundToPrecision(-0.2381), RoundToPrecision(4.80952)}, {{ {{-10 , -3}, {0 , 5}}, {{-3 , -9}, {0 , 6}}, } }}
-        //     },
-        // },
-        // {
-        //     .Input = {{{3, -10}, {4, 3}}, {{-5 , -8}, {8 , 0}}, {{-2 , -10}, {8 , -8}}},
-        //     .Expected = {
-        //         {{RoundToPrecision(3.55901), RoundToPrecision(-2.73292)}, {{ {{-5 , -8}, {8 , 0}}, {{3 , -10}, {4 , 3}}, } }},
-        //         {{RoundToPrecision(3.07813), RoundToPrecision(-8.98438)}, {{ {{-2 , -10}, {8 , -8}}, {{3 , -10}, {4 , 3}}, } }},
-        //     },
-        // },
-        {
-            .Input = {{{-1, 0}, {1, 2}}, {{-10 , -2}, {-6 , -8}}, {{-7 , -9}, {3 , 8}}},
-            .Expected = {
-                {{RoundToPrecision(-6.21875), RoundToPrecision(-7.67188)}, {{ {{-10 , -2}, {-6 , -8}}, {{-7 , -9}, {3 , 8}} } }},
-            },
-        },
+    static const int QueriesCount = 1000000;
+    static const int ScannedQueriesCount = 100;
+
+    std::vector<TPoint> points;
+    points.reserve(QueriesCount);
+    for (int i = 0; i < QueriesCount; ++i) {
+        points.push_back({.X = RandomInRange(0, maxValue * 10) / 10.0, .Y = RandomInRange(0, maxValue * 10) / 10.0});
+    }
+
+    TSegmentRTree tree(input);
+
+    auto measure = [&] (int threadsCount) {
+        auto start = std::chrono::steady_clock::now();
+        auto result = tree.FindNearest(points, threadsCount);
+        return std::pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), result);
     };
 
-    Normalize(tests);
+    auto [single, nearest] = measure(1);
 
-    // const auto& test = tests.front();
+    auto start = std::chrono::steady_clock::now();
+    bool isSame = true;
+    for (int i = 0; i < ScannedQueriesCount; ++i) {
+        isSame &= IsSameNearest(nearest[i], LinearScanNearest(input, points[i]));
+    }
+    auto scan = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / ScannedQueriesCount;
 
-    // auto s1 = test.Input[0];
-    // auto s2 = test.Input[2];
+    std::cout << name << ", segments: " << input.size()
+        << ", nearest segment queries: " << QueriesCount
+        << ", R-tree: " << QueriesCount / single << " queries/s";
 
-    // auto pointX = RoundToPrecision(-10);
-    // TTrackingSegment ts1(&s1, pointX);
-    // TTrackingSegment ts2(&s2, pointX);
+    for (int threadsCount : {2, 4, static_cast<int>(std::thread::hardware_concurrency())}) {
+        auto [elapsed, result] = measure(threadsCount);
+        std::cout << ", in " << threadsCount << " threads: " << QueriesCount / elapsed << " queries/s";
+    }
 
-    // bool result = ts1 < ts2;
-    // std::cout << result << std::endl;
+    std::cout << ", linear scan: " << 1 / scan << " queries/s"
+        << ", same distances: " << isSame
+        << std::endl;
+}
 
-    // std::cout << "ts1: " << *ts1.Parameters.GetAtX(pointX) << std::endl; 
-    // std::cout << "ts2: " << *ts2.Parameters.GetAtX(pointX) << std::endl;
+void BenchmarkRings(const std::string& name, int polygonsCount, int minVertices, int maxVertices)
+{
+    std::vector<std::vector<TPoint>> rings;
+    rings.reserve(polygonsCount);
+    for (int i = 0; i < polygonsCount; ++i) {
+        rings.push_back(RandomStarRing(minVertices + i % (maxVertices - minVertices + 1), RandomPoint(0, 1000000), 1000));
+    }
 
-    for (const auto& test : tests) {
-        if (!CheckTestCase(test, BruteForce(test.Input))) {
-            return 1;
+    auto start = std::chrono::steady_clock::now();
+    TRingValidator validator;
+    auto statuses = validator.Validate(rings);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto simpleCount = std::count(statuses.begin(), statuses.end(), ERingStatus::Simple);
+
+    // Baseline: all intersections of the edges by the sweep, shared vertices are reported too.
+    auto baselineCount = std::min(polygonsCount, 10000);
+    start = std::chrono::steady_clock::now();
+    int64_t reportedPoints = 0;
+    for (int i = 0; i < baselineCount; ++i) {
+        std::vector<TSegment> edges;
+        for (int j = 0; j < std::ssize(rings[i]); ++j) {
+            TSegment edge {.Begin = rings[i][j], .End = rings[i][(j + 1) % rings[i].size()]};
+            edge.Normalize();
+            edges.push_back(edge);
         }
+        reportedPoints += SweepLine(edges).size();
     }
+    auto baseline = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    std::cout << "OK" << std::endl;
+    std::cout << name << ", polygons: " << polygonsCount
+        << ", vertices: " << minVertices << "-" << maxVertices
+        << ", simple: " << simpleCount
+        << ", time: " << elapsed << " s"
+        << ", throughput: " << polygonsCount / elapsed << " polygons/s"
+        << " (full sweep: " << baselineCount / baseline << " polygons/s, " << reportedPoints << " points)"
+        << std::endl;
+}
+
+void BenchmarkIncremental(const std::string& name, const std::vector<TSegment>& input, int64_t cellSide)
+{
+    static const int UpdatesCount = 10000;
+
+    auto start = std::chrono::steady_clock::now();
+    TIncrementalIntersections intersections(cellSide);
+    for (int i = 0; i + UpdatesCount < std::ssize(input); ++i) {
+        intersections.Insert(input[i]);
+    }
+    auto load = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Every update removes the oldest segment and adds a new one.
+    start = std::chrono::steady_clock::now();
+    std::vector<TIncrementalIntersections::TCrossing> crossings;
+    for (int i = 0; i < UpdatesCount; ++i) {
+        intersections.Remove(i);
+        intersections.Insert(input[std::ssize(input) - UpdatesCount + i], &crossings);
+    }
+    auto updates = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto result = SweepLine(intersections.GetSegments());
+    auto recompute = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << name << ", segments: " << input.size() - UpdatesCount
+        << ", incremental load: " << load << " s"
+        << ", update (remove + insert): " << updates / UpdatesCount * 1e6 << " us"
+        << ", full recompute: " << recompute << " s"
+        << ", results match: " << (result == intersections.GetIntersections())
+        << std::endl;
+}
+
+void BenchmarkLoaders(const std::vector<TSegment>& input)
+{
+    auto directory = std::filesystem::temp_directory_path();
+    auto binaryPath = (directory / "segments_bench.bin").string();
+    auto textPath = (directory / "segments_bench.txt").string();
+
+    WriteSegments(binaryPath, input);
+    {
+        std::ofstream text(textPath);
+        for (const auto& segment : input) {
+            text << segment.Begin.X << ' ' << segment.Begin.Y << ' ' << segment.End.X << ' ' << segment.End.Y << '\n';
+        }
+    }
+
+    auto measure = [] (auto&& load) {
+        auto start = std::chrono::steady_clock::now();
+        auto count = load();
+        return std::make_pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), count);
+    };
+
+    // Summing coordinates touches every page of the mapping.
+    auto [mapped, mappedCount] = measure([&] {
+        TMappedFile file(binaryPath);
+        double sum = 0;
+        for (const auto& segment : MapSegments(file)) {
+            sum += segment.Begin.X;
+        }
+        return MapSegments(file).size() + (sum < 0);
+    });
+    auto [parsed, parsedCount] = measure([&] {
+        TMappedFile file(textPath);
+        return ParseSegments(file.GetText()).size();
+    });
+    auto [streamed, streamedCount] = measure([&] {
+        std::ifstream text(textPath);
+        std::vector<TSegment> result;
+        TSegment segment;
+        while (text >> segment.Begin.X >> segment.Begin.Y >> segment.End.X >> segment.End.Y) {
+            result.push_back(segment);
+        }
+        return result.size();
+    });
+
+    auto textSize = std::filesystem::file_size(textPath) / 1048576.0;
+    std::cout << "loaders, segments: " << input.size()
+        << ", binary mmap: " << mapped << " s"
+        << ", text from_chars: " << parsed << " s (" << textSize / parsed << " MiB/s)"
+        << ", text iostream: " << streamed << " s (" << textSize / streamed << " MiB/s)"
+        << ", counts match: " << (mappedCount == parsedCount && parsedCount == streamedCount)
+        << std::endl;
+
+    std::filesystem::remove(binaryPath);
+    std::filesystem::remove(textPath);
+}
+
+// Besides the wall time, reports CPU times: the total one of all threads shows
+// the work added by the split, the one of the split, the longest slab and the
+// merge is the time on a machine with a core per slab.
+void BenchmarkScaling(const std::string& name, const std::vector<TSegment>& input)
+{
+    double baseline = 0;
+    double baselineCpu = 0;
+    for (int threadsCount : {1, 2, 4, 8}) {
+        TSlabStats stats;
+        auto start = std::chrono::steady_clock::now();
+        auto cpuStart = GetThreadSeconds();
+        auto result = SweepLineParallel(input, threadsCount, &stats);
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (threadsCount == 1) {
+            baseline = elapsed;
+            baselineCpu = GetThreadSeconds() - cpuStart;
+        }
+
+        std::cout << name << ", segments: " << input.size()
+            << ", threads: " << threadsCount
+            << ", intersection points: " << result.size()
+            << ", time: " << elapsed << " s"
+            << ", speedup: " << baseline / elapsed;
+        if (!stats.SlabSeconds.empty()) {
+            auto total = std::accumulate(stats.SlabSeconds.begin(), stats.SlabSeconds.end(), stats.SplitSeconds + stats.MergeSeconds);
+            auto critical = stats.SplitSeconds + *std::max_element(stats.SlabSeconds.begin(), stats.SlabSeconds.end()) + stats.MergeSeconds;
+            std::cout << ", cpu: " << total << " s (serial " << baselineCpu << " s)"
+                << ", cpu with a core per slab: " << critical << " s"
+                << ", speedup with a core per slab: " << baselineCpu / critical;
+        }
+        std::cout << std::endl;
+    }
+}
+
+void Benchmark()
+{
+    static const int SegmentsCount = 1000000;
+    static const int MaxValue = 1000000;
+    static const int MaxLength = 1000;
+
+    BenchmarkOutput("long random", RandomSegments(4000, 0, MaxValue));
+    BenchmarkSweepLine("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength));
+    BenchmarkSweepLine("long parallel", ParallelSegments(SegmentsCount, MaxValue));
+    BenchmarkSetup("short random", RandomShortSegments(10 * SegmentsCount, MaxValue, MaxLength));
+    {
+        // Red layer is long segments crossing each other, blue layer is short segments.
+        auto red = RandomSegments(2000, 0, MaxValue);
+        auto blue = RandomShortSegments(20000, MaxValue, MaxLength * 10);
+        std::sort(red.begin(), red.end());
+        BenchmarkRedBlue(red, blue);
+    }
+    {
+        // Layers where segments share vertices gain the most from skipping
+        // pairs of the same layer.
+        BenchmarkCrossingFreeRedBlue("lattices", LatticeNetwork(300, 100, {0, 0}), LatticeNetwork(300, 100, {37, 11}));
+
+        auto red = RemoveCrossings(RandomShortSegments(SegmentsCount, MaxValue, MaxLength * 10));
+        auto blue = RemoveCrossings(RandomShortSegments(SegmentsCount, MaxValue, MaxLength * 10));
+        BenchmarkCrossingFreeRedBlue("short random without crossings", red, blue);
+    }
+
+    BenchmarkGrid("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength));
+    BenchmarkGrid("very short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength / 10));
+
+    BenchmarkRTree("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength), MaxValue, MaxLength);
+    BenchmarkNearestSegment("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength), MaxValue);
+
+    BenchmarkRings("small rings", 1000000, 4, 16);
+    BenchmarkRings("large rings", 1000, 500, 2000);
+
+    BenchmarkIncremental("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength), MaxLength);
+    {
+        // Long updates cross a small part of the cells of their bounding boxes.
+        auto input = RandomShortSegments(SegmentsCount, MaxValue, MaxLength);
+        auto updates = RandomShortSegments(10000, MaxValue, MaxLength * 30);
+        std::copy(updates.begin(), updates.end(), input.end() - updates.size());
+        BenchmarkIncremental("short random, long updates", input, MaxLength);
+    }
+
+    {
+        auto input = RandomShortSegments(SegmentsCount, MaxValue, MaxLength);
+        BenchmarkAllocations("short random, count", [&] { return CountIntersections(input).Points; });
+        BenchmarkAllocations("short random, map", [&] { return SweepLine(input).size(); });
+        BenchmarkAllocations("short random, 4 slabs", [&] { return SweepLineParallel(input, 4).size(); });
+        BenchmarkAllocations("short random, map in arena", [&] {
+            std::pmr::monotonic_buffer_resource resource;
+            return SweepLine(input, &resource).size();
+        });
+    }
+
+    BenchmarkLoaders(RandomShortSegments(SegmentsCount, MaxValue, MaxLength));
+
+    BenchmarkAnyIntersection("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength));
+    BenchmarkAnyIntersection("long parallel", ParallelSegments(SegmentsCount, MaxValue));
+
+    std::cout << "hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+    BenchmarkScaling("short random", RandomShortSegments(SegmentsCount, MaxValue, MaxLength));
+    BenchmarkScaling("long random", RandomSegments(2000, 0, MaxValue));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Workloads of the benchmark suite. Every generator makes count segments and
+// controls k, the number of intersections, relative to n.
+
+// Short segments spread so that the density does not depend on n: k ~ n.
+std::vector<TSegment> SparseSegments(int count)
+{
+    static const int MaxLength = 1000;
+    return RandomShortSegments(count, static_cast<int>(1000 * std::sqrt(count)), MaxLength);
+}
+
+// Long segments across the whole square: k ~ n^2.
+std::vector<TSegment> DenseSegments(int count)
+{
+    return RandomSegments(count, 0, 1000000);
+}
+
+// Horizontal and vertical segments on distinct lines, each crossing about a
+// tenth of the perpendicular ones.
+std::vector<TSegment> AxisParallelSegments(int count)
+{
+    int side = 2 * count;
+    std::vector<TSegment> result;
+    result.reserve(count);
+
+    for (int i = 0; i < count; ++i) {
+        double line = i;
+        double begin = RandomInRange(0, side - side / 10);
+        double end = begin + RandomInRange(0, side / 10) + 1;
+
+        if (i % 2 == 0) {
+            result.push_back({.Begin = {.X = begin, .Y = line}, .End = {.X = end, .Y = line}});
+        } else {
+            result.push_back({.Begin = {.X = line, .Y = begin}, .End = {.X = line, .Y = end}});
+        }
+    }
+
+    return result;
+}
+
+// All segments pass through one point with distinct slopes: one event with n
+// segments.
+std::vector<TSegment> StarSegments(int count)
+{
+    static constexpr double Center = 1000000;
+
+    std::vector<TSegment> result;
+    result.reserve(count);
+
+    for (int i = 1; i <= count; ++i) {
+        double dx = i;
+        double dy = count + 1 - i;
+        result.push_back({
+            .Begin = {.X = Center - dx, .Y = Center - dy},
+            .End = {.X = Center + dx, .Y = Center + dy},
+        });
+    }
+
+    return result;
+}
+
+// Bundles of long segments with almost the same slope, where nearly parallel
+// neighbors cross: k ~ n * BundleSize.
+std::vector<TSegment> BundleSegments(int count)
+{
+    static const int BundleSize = 32;
+    static const int Length = 100000;
+    static const int Spacing = 10;
+    static const int Jitter = 20;
+
+    std::vector<TSegment> result;
+    result.reserve(count);
+
+    while (std::ssize(result) < count) {
+        auto x = RandomInRange(0, 1000000);
+        auto y = RandomInRange(0, 1000000);
+        auto rise = RandomInRange(-Length, Length);
+
+        for (int i = 0; i < BundleSize && std::ssize(result) < count; ++i) {
+            result.push_back({
+                .Begin = {.X = x, .Y = y + i * Spacing},
+                .End = {.X = x + Length, .Y = y + i * Spacing + rise + RandomInRange(-Jitter, Jitter)},
+            });
+            result.back().Normalize();
+        }
+    }
+
+    return result;
+}
+
+struct TSuiteRun
+{
+    int SegmentsCount = 0;
+    std::string Engine;
+    // Average of the repeats.
+    double Seconds = 0;
+    int Repeats = 0;
+    int64_t IntersectionPoints = 0;
+    std::optional<int64_t> Events;
+};
+
+// Times every engine on every workload for growing n and prints JSON. A run is
+// skipped when quadratic growth from the previous run of the engine predicts it
+// to take longer than maxSeconds, so slow engines drop out where others carry on.
+// Points reported by engines for the same input must match.
+void BenchmarkSuite(int maxSegmentsCount, double maxSeconds)
+{
+    using TGenerator = std::function<std::vector<TSegment>(int)>;
+    using TEngine = std::function<std::pair<int64_t, std::optional<int64_t>>(const std::vector<TSegment>&)>;
+
+    std::vector<std::pair<std::string, TGenerator>> workloads {
+        {"sparse short", SparseSegments},
+        {"dense long", DenseSegments},
+        {"axis parallel", AxisParallelSegments},
+        {"star", StarSegments},
+        {"near parallel bundles", BundleSegments},
+    };
+
+    std::vector<std::pair<std::string, TEngine>> engines {
+        {"brute force", [] (const std::vector<TSegment>& input) {
+            return std::pair<int64_t, std::optional<int64_t>>(BruteForce(input).size(), std::nullopt);
+        }},
+        {"sweep line", [] (const std::vector<TSegment>& input) {
+            TSweepStats stats;
+            auto points = SweepLine(input, &stats).size();
+            return std::pair<int64_t, std::optional<int64_t>>(points, stats.Events);
+        }},
+        {"sweep line, counting", [] (const std::vector<TSegment>& input) {
+            TSweepStats stats;
+            auto points = CountIntersections(input, &stats).Points;
+            return std::pair<int64_t, std::optional<int64_t>>(points, stats.Events);
+        }},
+        {"segment grid", [] (const std::vector<TSegment>& input) {
+            return std::pair<int64_t, std::optional<int64_t>>(GridIntersections(input).size(), std::nullopt);
+        }},
+    };
+
+    std::cout << "{\"workloads\": [";
+
+    for (int workload = 0; workload < std::ssize(workloads); ++workload) {
+        const auto& [name, generate] = workloads[workload];
+
+        std::vector<TSuiteRun> runs;
+        std::vector<std::optional<TSuiteRun>> lastRuns(engines.size());
+        std::optional<int> crossover;
+
+        for (int count : {10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000, 300000, 1000000}) {
+            if (count > maxSegmentsCount) {
+                break;
+            }
+
+            std::vector<int> scheduled;
+            for (int engine = 0; engine < std::ssize(engines); ++engine) {
+                const auto& last = lastRuns[engine];
+                if (!last || last->Seconds * std::pow(static_cast<double>(count) / last->SegmentsCount, 2) <= maxSeconds) {
+                    scheduled.push_back(engine);
+                }
+            }
+            if (scheduled.empty()) {
+                break;
+            }
+
+            auto input = generate(count);
+            std::optional<int64_t> expectedPoints;
+            std::map<std::string, double> seconds;
+
+            for (auto engine : scheduled) {
+                // Small inputs are repeated to measure more than the timer noise.
+                int repeats = 0;
+                std::pair<int64_t, std::optional<int64_t>> result;
+                auto start = std::chrono::steady_clock::now();
+                do {
+                    result = engines[engine].second(input);
+                    ++repeats;
+                } while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10));
+                auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+                auto [points, events] = result;
+
+                Verify(!expectedPoints || *expectedPoints == points);
+                expectedPoints = points;
+                seconds[engines[engine].first] = elapsed;
+
+                runs.push_back({
+                    .SegmentsCount = count,
+                    .Engine = engines[engine].first,
+                    .Seconds = elapsed,
+                    .Repeats = repeats,
+                    .IntersectionPoints = points,
+                    .Events = events,
+                });
+                lastRuns[engine] = runs.back();
+            }
+
+            if (!crossover && seconds.contains("brute force") && seconds.contains("sweep line")
+                && seconds["sweep line"] < seconds["brute force"])
+            {
+                crossover = count;
+            }
+        }
+
+        std::cout << (workload ? "," : "") << "\n  {\"name\": \"" << name << "\", "
+            << "\"sweep_line_faster_than_brute_force_from\": ";
+        if (crossover) {
+            std::cout << *crossover;
+        } else {
+            std::cout << "null";
+        }
+        std::cout << ", \"runs\": [";
+
+        for (int i = 0; i < std::ssize(runs); ++i) {
+            const auto& run = runs[i];
+            std::cout << (i ? "," : "") << "\n    {\"segments\": " << run.SegmentsCount
+                << ", \"engine\": \"" << run.Engine << "\""
+                << ", \"seconds\": " << run.Seconds
+                << ", \"repeats\": " << run.Repeats
+                << ", \"intersection_points\": " << run.IntersectionPoints
+                << ", \"intersections_per_second\": " << run.IntersectionPoints / std::max(run.Seconds, 1e-9)
+                << ", \"events\": ";
+            if (run.Events) {
+                std::cout << *run.Events;
+            } else {
+                std::cout << "null";
+            }
+            std::cout << "}";
+        }
+        std::cout << "]}";
+    }
+
+    std::cout << "\n]}" << std::endl;
+}
+
+// Counts intersections of segments from a binary or text file.
+int Intersect(const std::string& path, int threadsCount)
+{
+    auto start = std::chrono::steady_clock::now();
+    TMappedFile file(path);
+    std::vector<TSegment> parsed;
+    std::span<const TSegment> input;
+    if (IsBinary(file, SegmentsMagic)) {
+        input = MapSegments(file);
+    } else {
+        parsed = ParseSegments(file.GetText());
+        input = parsed;
+    }
+    auto load = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    try {
+        VerifySupported(input);
+    } catch (const std::runtime_error& error) {
+        std::cerr << path << ": " << error.what() << std::endl;
+        return 1;
+    }
+
+    TSweepStats stats;
+    auto count = CountIntersections(input, &stats, threadsCount);
+
+    std::cout << "segments: " << input.size()
+        << ", intersection points: " << count.Points
+        << ", load: " << load << " s"
+        << ", event queue setup: " << stats.SetupSeconds << " s"
+        << ", sweep: " << stats.SweepSeconds << " s"
+        << std::endl;
     return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+#if TRACING_ENABLED
+    std::atexit(DumpTrace);
+#endif
+
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        Benchmark();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "fuzz") {
+        uint64_t seed = argc > 2 ? std::stoull(argv[2]) : 1;
+        int64_t casesCount = argc > 3 ? std::stoll(argv[3]) : 1000000;
+        int threadsCount = argc > 4 ? std::stoi(argv[4]) : 0;
+        return FuzzTest(seed, casesCount, threadsCount, GenerateFuzzCase, IsCorrect, PrintFuzzCase);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "suite") {
+        int maxSegmentsCount = argc > 2 ? std::stoi(argv[2]) : 300000;
+        double maxSeconds = argc > 3 ? std::stod(argv[3]) : 3;
+        BenchmarkSuite(maxSegmentsCount, maxSeconds);
+        return 0;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "intersect") {
+        int threadsCount = argc > 3 ? std::stoi(argv[3]) : std::thread::hardware_concurrency();
+        return Intersect(argv[2], threadsCount);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "stress") {
+        return StressTest() || ParallelStressTest() || EventQueueStressTest() || AnyIntersectionStressTest() || RedBlueStressTest() || RTreeStressTest() || RingValidatorStressTest() || IncrementalStressTest();
+    }
+
     return test();
 }
\ No newline at end of file